@@ -0,0 +1,15 @@
+#ifndef _SYS_VMSTAT_H_
+#define _SYS_VMSTAT_H_
+
+/*
+ * Get struct vmstat and the VMSTAT_ codes from the kernel
+ */
+#include <kern/vmstat.h>
+
+/*
+ * Copy the system's VM counters (VMSTAT_SYSTEM) or the calling
+ * process's own (VMSTAT_SELF) into BUF.
+ */
+int vmstat(int which, struct vmstat *buf);
+
+#endif /* _SYS_VMSTAT_H_ */
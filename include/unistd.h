@@ -122,6 +122,12 @@ time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle, off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+/* Returned by mmap on error */
+#define MAP_FAILED ((void *)-1)
 
 /*
  * These are not themselves system calls, but wrapper routines in libc.
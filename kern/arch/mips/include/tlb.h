@@ -24,20 +24,27 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   TLB_SetPID: make PID the address space ID the processor matches
+ *        non-global TLB entries against.
+ *
+ * All of the above except TLB_SetPID leave the current PID alone.
  */
 
 void TLB_Random(u_int32_t entryhi, u_int32_t entrylo);
 void TLB_Write(u_int32_t entryhi, u_int32_t entrylo, u_int32_t index);
 void TLB_Read(u_int32_t *entryhi, u_int32_t *entrylo, u_int32_t index);
 int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
+void TLB_SetPID(u_int32_t pid);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID. Every
+ * address space gets one so that its entries can stay in the TLB across
+ * context switches. TLBLO_GLOBAL (match any address space ID) is only
+ * set on kseg2 mappings; the bits that aren't assigned a meaning can be
+ * left always zero.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -49,14 +56,15 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
 #define TLBLO_NOCACHE 0x00000800
 #define TLBLO_DIRTY   0x00000400
 #define TLBLO_VALID   0x00000200
-/*      TLBLO_GLOBAL  0x00000100 */
+#define TLBLO_GLOBAL  0x00000100
 
 /*
  * Values for completely invalid TLB entries. The TLB entry index should
@@ -72,5 +80,11 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs (values for TLBHI_PID).
+ */
+
+#define NUM_TLB_PID  64
+
 
 #endif /* _MACHINE_TLB_H_ */
@@ -79,5 +79,11 @@ int sys_exit(struct trapframe *tf);
 int sys_waitpid(void *parent_proc, int pid, int *status);
 int sys_execv(struct trapframe *tf);
 int sys_sbrk (int amount, int *retval);
+int sys_open(struct trapframe *tf, int *retval);
+int sys_close(int fd);
+int sys_mmap(struct trapframe *tf, int *retval);
+int sys_munmap(struct trapframe *tf);
+int sys_msync(struct trapframe *tf);
+int sys_vmstat(int which, userptr_t buf);
 
 #endif /* _MIPS_TRAPFRAME_H_ */
@@ -10,7 +10,13 @@
 #include <machine/tlb.h>
 #include <elf.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <synch.h>
+#include <uio.h>
+#include <kern/unistd.h>
+#include <kern/stat.h>
+#include <kern/vmstat.h>
+#include <slab.h>
 
 /*
  * RAM available for kernel and user page allocations and deallocations
@@ -22,7 +28,156 @@ struct lock *core_map_lock = NULL;
 static struct page *pages = NULL;
 static int num_pages = 0;
 
-struct page_table* get_ptbl(struct addrspace *as, vaddr_t vpn, int is_executable);
+/*
+ * Shared with the UTLB refill fast path in exception.S, which enters
+ * resident pages in the TLB without calling vm_fault. utlb_pgdir is the
+ * page directory of the active address space (NULL if none). utlb_coremap
+ * is where the core map entry for frame number 0 would be, so the one for
+ * frame number n is n * sizeof(struct page) bytes after it. utlb_refills
+ * counts the misses handled there.
+ */
+struct page_directory *utlb_pgdir = NULL;
+u_int32_t utlb_coremap = 0;
+u_int32_t utlb_refills = 0;
+
+/*
+ * Free frames are kept by a buddy allocator. A free block of 2^order frames
+ * starts at a core map index that is a multiple of 2^order. It is on
+ * free_lists[order], linked through next_free/prev_free of its first core map
+ * entry, whose flags are PFLAG_FREE_BLOCK | order. All other entries of a free
+ * block have their flags zeroed.
+ */
+#define BUDDY_MAX_ORDER 15
+static int free_lists[BUDDY_MAX_ORDER + 1];
+static int num_free_pages = 0;
+
+static void coremap_free_run(int index, int count);
+static int coremap_alloc_run(int count);
+static int reclaim_page_table(void);
+static int clock_find_victim(void);
+static void page_cache_remove(int index);
+
+/*
+ * Page cache. Processes running the same executable share its text pages,
+ * and processes mapping the same file MAP_SHARED share its pages: a page in
+ * memory is found by (vnode, file offset) and mapped into every address
+ * space that faults on it. The core map refcount counts the mappings, as
+ * for copy-on-write sharing. Cached frames are marked PFLAG_CACHED and
+ * chained through cache_next from a hash bucket. The key isn't stored, it
+ * is worked out from the frame's address space and page (see
+ * page_cache_key). A frame leaves the cache when it is freed.
+ */
+#define PAGE_CACHE_BUCKETS 64
+static int page_cache[PAGE_CACHE_BUCKETS];
+
+/*
+ * Page replacement policy (the "policy" tunable)
+ */
+#define VM_POLICY_RANDOM	0
+#define VM_POLICY_CLOCK		1
+static int vm_replace_policy = VM_POLICY_CLOCK;
+
+/* Clock hand for VM_POLICY_CLOCK. A core map index */
+static int clock_hand = 0;
+
+/*
+ * A frame of zeros, mapped copy-on-write wherever untouched anonymous
+ * memory is read. It belongs to the kernel, so it is never evicted, and
+ * its refcount is one more than the number of mappings so it is never
+ * freed either.
+ */
+static paddr_t zero_page = 0;
+
+/*
+ * The pageout daemon wakes up when the number of free pages drops below
+ * pageout_low and evicts pages until there are pageout_high free ones.
+ * Both are set from the core map size in pageout_bootstrap.
+ */
+static int pageout_low = 0;
+static int pageout_high = 0;
+static struct thread *pageout_thread = NULL;
+
+/*
+ * Most pages written out together when a dirty page is evicted, and most
+ * pages read in behind a swapped in page ("swap_cluster" and
+ * "swap_readahead")
+ */
+static int swap_cluster_pages = SWAP_CLUSTER_MAX;
+static int swap_readahead_pages = SWAP_CLUSTER_MAX - 1;
+
+/*
+ * Most resident, referenced pages after a faulting one entered in the TLB with it
+ * ("fault_around"), and most pages loaded ahead from the executable when
+ * a program is reading through it sequentially ("exec_readahead")
+ */
+#define VM_MAX_FAULT_AROUND 16
+static int fault_around_pages = 4;
+static int exec_readahead_pages = 4;
+
+/*
+ * Most pages a new process's stack may grow to ("stack_max"; a process
+ * keeps the limit it started with), and how many pages below a fault that
+ * grows the stack are given zeroed frames straight away ("stack_prefault").
+ * The stack has to stay above the mmap area.
+ */
+#define VM_MAX_STACK_PAGES	((USERSTACK - VM_MMAP_TOP) / PAGE_SIZE)
+static int stack_max_pages = 256;
+static int stack_prefault_pages = 4;
+
+/*
+ * Most pages a new process's heap may grow to ("heap_max"). The heap has
+ * to stay below the mmap area whatever this says.
+ */
+#define VM_MAX_HEAP_PAGES	(VM_MMAP_BASE / PAGE_SIZE)
+static int heap_max_pages = 256;
+
+/*
+ * Working set admission control (see ws_update). The working sets are
+ * estimated every "ws_window" faults for pages that weren't in memory
+ * while memory is short, 0 turns it off. ws_updates counts the estimates
+ * made so suspended processes can tell whether anybody made one lately.
+ */
+static int ws_window = 64;
+static int ws_window_faults = 0;
+static int ws_nsuspended = 0;
+static u_int32_t ws_updates = 0;
+
+/*
+ * VM counters for the whole system (see kern/vmstat.h). Each address space
+ * has its own set as well. Printed by vm_printstats and returned by the
+ * vmstat system call.
+ */
+static struct vmstat vmstats;
+
+/*
+ * Count 'n' events of kind 'field' for the system and for address space 'as'
+ */
+#define VMSTAT_ADD(as, field, n) \
+	do { vmstats.field += (n); (as)->as_stats.field += (n); } while(0)
+
+/* All live address spaces. Protected by the core map lock */
+static struct addrspace *as_list = NULL;
+
+/*
+ * Address spaces and their page directories come from object caches. A
+ * page directory is zeroed once when it is first allocated and handed
+ * back zeroed by as_destroy, so as_create doesn't clear it every time.
+ */
+static int pg_dir_ctor(void *pg_dir);
+
+static struct slab_cache as_cache =
+	SLAB_CACHE_INITIALIZER("addrspace", sizeof(struct addrspace), NULL, NULL);
+static struct slab_cache pg_dir_cache =
+	SLAB_CACHE_INITIALIZER("pg_dir", 1024 * sizeof(struct page_directory),
+			       pg_dir_ctor, NULL);
+
+/*
+ * TLB address space IDs are handed out in order. When we run out, the TLB is
+ * flushed and a new generation starts; every address space then picks up a
+ * new ASID the next time it is activated.
+ */
+static u_int32_t next_asid = 0;
+static u_int32_t asid_generation = 1;
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -31,8 +186,6 @@ struct page_table* get_ptbl(struct addrspace *as, vaddr_t vpn, int is_executable
  * assignment, this file is not included in your kernel!
  */
 
-/* under dumbvm, always have 96k of user stack */
-#define DUMBVM_STACKPAGES    24
 #define MIN_COREMAP_PAGES 10
 
 void
@@ -77,9 +230,33 @@ vm_bootstrap(void)
 	free_paddr = pages_start_addr;
 	last_paddr = free_paddr + PAGE_SIZE * num_pages;
 
+	// The fast refill path has the layout of struct page built in
+	assert(sizeof(struct page) == 32 && (char*)&pages->flags - (char*)pages == 8);
+	utlb_coremap = (u_int32_t)pages - (free_paddr / PAGE_SIZE) * sizeof(struct page);
+
 	// set core map to zero. Means none of the pages are currently valid.
 	bzero(pages, coremapsize_bytes);
 
+	// Hand all the pages to the free lists
+	int i;
+	for(i = 0; i <= BUDDY_MAX_ORDER; ++i)
+	{
+		free_lists[i] = -1;
+	}
+	for(i = 0; i < PAGE_CACHE_BUCKETS; ++i)
+	{
+		page_cache[i] = -1;
+	}
+	coremap_free_run(0, num_pages);
+
+	i = coremap_alloc_run(1);
+	assert(i != -1);
+	pages[i].as = NULL;
+	pages[i].flags = PFLAG_USED_MASK;
+	pages[i].refcount = 1;
+	zero_page = free_paddr + i * PAGE_SIZE;
+	bzero((void*)PADDR_TO_KVADDR(zero_page), PAGE_SIZE);
+
 	// Print stats about the core map. Might be handy for debugging purposes
 	coremapsize_kbytes = coremapsize_bytes / 1024;
 	coremapsize_bytes = coremapsize_bytes % 1024;
@@ -105,30 +282,148 @@ getppages(unsigned long npages)
 	return addr;
 }
 
+static void free_list_insert(int index, int order)
+{
+	pages[index].flags = PFLAG_FREE_BLOCK | order;
+	pages[index].prev_free = -1;
+	pages[index].next_free = free_lists[order];
+	if(free_lists[order] != -1)
+	{
+		pages[free_lists[order]].prev_free = index;
+	}
+	free_lists[order] = index;
+}
+
+static void free_list_remove(int index, int order)
+{
+	if(pages[index].prev_free != -1)
+	{
+		pages[pages[index].prev_free].next_free = pages[index].next_free;
+	}
+	else
+	{
+		free_lists[order] = pages[index].next_free;
+	}
+	if(pages[index].next_free != -1)
+	{
+		pages[pages[index].next_free].prev_free = pages[index].prev_free;
+	}
+	pages[index].flags = 0;
+}
+
 /*
- * Function to determine if a contiguous 'npages' pages are available
- * in the coremap starting from the 'start' location
- * The actual number of contiguous free pages from 'start' will
- * be store in count.
+ * Take a block of 2^order frames off the free lists, splitting a larger
+ * block if we have to. Returns the first core map index or -1.
  */
-int can_i_alloc_npages(struct page *start, unsigned long npages, unsigned long *count)
+static int buddy_alloc(int order)
 {
-	*count = 0;
-	vaddr_t start_vaddr = (vaddr_t)start;
-	vaddr_t coremap_end_addr = (vaddr_t)(pages + num_pages);
+	int k = order;
+	while(k <= BUDDY_MAX_ORDER && free_lists[k] == -1)
+	{
+		k++;
+	}
+	if(k > BUDDY_MAX_ORDER)
+	{
+		return -1;
+	}
 
-	while(!(start->flags & PFLAG_USED_MASK) && (*count < npages) &&
-			(start_vaddr < coremap_end_addr))
+	int index = free_lists[k];
+	free_list_remove(index, k);
+	// Give back the upper halves we don't need
+	while(k > order)
 	{
-		(*count)++;
-		start++;
-		start_vaddr = (vaddr_t)start;
+		k--;
+		free_list_insert(index + (1 << k), k);
 	}
+	num_free_pages -= 1 << order;
+	return index;
+}
 
-	if(*count == npages)
-		return 1; // contiguous pages available!
-	else
-		return 0;
+/*
+ * Put the block of 2^order frames at 'index' on the free lists, merging it
+ * with its buddy for as long as the buddy is free too.
+ */
+static void buddy_free(int index, int order)
+{
+	num_free_pages += 1 << order;
+	pages[index].flags = 0;
+	while(order < BUDDY_MAX_ORDER)
+	{
+		int buddy = index ^ (1 << order);
+		if(buddy + (1 << order) > num_pages ||
+				pages[buddy].flags != (PFLAG_FREE_BLOCK | order))
+		{
+			break;
+		}
+		free_list_remove(buddy, order);
+		index &= ~(1 << order);
+		order++;
+	}
+	free_list_insert(index, order);
+}
+
+/*
+ * Free 'count' frames starting at core map entry 'index'. The run is handed
+ * back as the largest aligned blocks that fit in it.
+ */
+static void coremap_free_run(int index, int count)
+{
+	int i, order, end = index + count;
+	int spl = splhigh();
+
+	for(i = index; i < end; ++i)
+	{
+		if(pages[i].flags & PFLAG_CACHED)
+		{
+			page_cache_remove(i);
+		}
+		pages[i].as = NULL;
+		pages[i].flags = 0;
+		pages[i].refcount = 0;
+	}
+	while(index < end)
+	{
+		order = 0;
+		while(order < BUDDY_MAX_ORDER && (index & (1 << order)) == 0 &&
+				index + (2 << order) <= end)
+		{
+			order++;
+		}
+		buddy_free(index, order);
+		index += 1 << order;
+	}
+	splx(spl);
+}
+
+/*
+ * Allocate 'count' contiguous frames. Returns the first core map index or -1.
+ * Requests that aren't a power of 2 give the tail of their block back.
+ */
+static int coremap_alloc_run(int count)
+{
+	int order = 0;
+	while((1 << order) < count)
+	{
+		order++;
+	}
+	if(order > BUDDY_MAX_ORDER)
+	{
+		return -1;
+	}
+
+	int spl = splhigh();
+	int index = buddy_alloc(order);
+	if(index != -1 && (1 << order) > count)
+	{
+		coremap_free_run(index + count, (1 << order) - count);
+	}
+	if(num_free_pages < pageout_low)
+	{
+		// Running low. Get the pageout daemon going
+		thread_wakeup(&pageout_thread);
+	}
+	splx(spl);
+	return index;
 }
 
 /*
@@ -154,27 +449,16 @@ static paddr_t getkpagesfromvm(unsigned long npages)
 	 * Our kernel requires a contiguous memory of 'npages' pages in memory
 	 */
 	paddr_t addr = 0;
-	int i = 0;
-	unsigned long count;
+	int i;
 
 	lock_acquire(core_map_lock);
-	while(i < num_pages)
+	i = coremap_alloc_run(npages);
+	if(i != -1)
 	{
-		if(can_i_alloc_npages(pages + i, npages, &count))
-		{
-			setup_coremap_for_kpages(pages + i, npages);
-			addr = free_paddr + i * PAGE_SIZE;
-			pages[i].flags |= ((u_int32_t)npages & PFLAG_NUM_CONTG_PAGES);
-//			kprintf("Allocated %lu pages from 0x%x to 0x%x\n", npages, addr, addr + npages * PAGE_SIZE);
-			break;
-		}
-		i += count;
-
-		// We couldn't get a large enough free memory chunk. Find the next free chunk
-		while(i < num_pages && (pages[i].flags & PFLAG_USED_MASK))
-		{
-			i++;
-		}
+		setup_coremap_for_kpages(pages + i, npages);
+		addr = free_paddr + i * PAGE_SIZE;
+		pages[i].flags |= ((u_int32_t)npages & PFLAG_NUM_CONTG_PAGES);
+//		kprintf("Allocated %lu pages from 0x%x to 0x%x\n", npages, addr, addr + npages * PAGE_SIZE);
 	}
 	lock_release(core_map_lock);
 
@@ -182,167 +466,1087 @@ static paddr_t getkpagesfromvm(unsigned long npages)
 }
 
 
-// Called by kernel when finished executing user program. This is to prevent
-// any leaks
-void reclaim_all_user_pages()
+/*
+ * Is 'vpn' in the executable region of 'as'?
+ */
+static int vpn_is_executable(struct addrspace *as, vaddr_t vpn)
 {
-	int spl = splhigh();
-	int i;
-	for(i = 0; i < num_pages; ++i)
+	vaddr_t exec_vbase, exec_vtop;
+	if(as->as_flags1 & PF_X)
 	{
-		if(pages[i].as != NULL)
-		{
-			pages[i].flags = 0;
-		}
+		exec_vbase = as->as_vbase1;
+		exec_vtop = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
 	}
-	splx(spl);
+	else
+	{
+		exec_vbase = as->as_vbase2;
+		exec_vtop = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	}
+	return (vpn >= exec_vbase && vpn < exec_vtop);
 }
 
-// This function will be called by a user process before going to sleep
-// in sys_waitpid. This function will evict its pages if the coremap is
-// full
-void evict_all_my_pages_if_necessary(struct addrspace *as)
+/*
+ * Return the page table entry for 'vpn' in 'as' or NULL if its page table
+ * isn't in memory. Page tables are only swapped out once none of their
+ * pages are in memory (see reclaim_page_table), so every page in memory
+ * can be found this way. The pointer is good while the core map stays
+ * locked, or at splhigh until we next sleep.
+ */
+static struct page_table* lookup_pte(struct addrspace *as, vaddr_t vpn)
 {
-	lock_acquire(core_map_lock);
+	int32_t entry = as->pg_dir[vpn >> 22].pg_dir_entry;
+	if(!(entry & PGDIR_PRESENT))
+	{
+		return NULL;
+	}
+	struct page_table *pg_tbl = (struct page_table*)PADDR_TO_KVADDR(entry & PAGE_FRAME);
+	return &pg_tbl[(vpn & PGTBL_INDEX) >> 12];
+}
 
-	int i;
-	// First scan the coremap to check if it is full. If not we just return
-	for(i = 0; i < num_pages; ++i)
+/*
+ * Permission flags of the ELF region holding 'vpn', or -1 if it isn't in one
+ */
+static int32_t elf_region_flags(struct addrspace *as, vaddr_t vpn)
+{
+	if(vpn >= as->as_vbase1 && vpn < as->as_vbase1 + as->as_npages1 * PAGE_SIZE)
 	{
-		if(!(pages[i].flags & PFLAG_USED_MASK))
-		{
-			// free page in coremap
-			lock_release(core_map_lock);
-			return;
-		}
+		return as->as_flags1;
+	}
+	if(vpn >= as->as_vbase2 && vpn < as->as_vbase2 + as->as_npages2 * PAGE_SIZE)
+	{
+		return as->as_flags2;
 	}
+	return -1;
+}
 
-	for(i = 0; i < num_pages; ++i)
+/*
+ * The file mapping of 'as' holding 'vpn', or NULL
+ */
+static struct vm_mapping* mapping_find(struct addrspace *as, vaddr_t vpn)
+{
+	struct vm_mapping *mm;
+	for(mm = as->as_mmaps; mm != NULL && mm->mm_start <= vpn; mm = mm->mm_next)
 	{
-		// 'as' is non NULL for user pages
-		if(pages[i].as == as && (pages[i].flags & PFLAG_USED_MASK))
+		if(vpn < mm->mm_start + mm->mm_npages * PAGE_SIZE)
 		{
-			// Is this vpn an executable page? In that case let the page table finder
-			// know. He will not evict this page table
-			int is_executable = (pages[i].vpn >= pages[i].as->as_vbase1) &&
-					(pages[i].vpn < (pages[i].as->as_vbase1 + pages[i].as->as_npages1 * PAGE_SIZE));
-			// Get this user's pages table for this vpn
-			struct page_table *pgtbl = get_ptbl(pages[i].as, pages[i].vpn, is_executable);
-			int page_index = (pages[i].vpn & PGTBL_INDEX) >> 12;
-			// His page mappping is not invalid
-			pgtbl[page_index].pg_tbl_entry &= ~PGTBL_VALID_MASK;
-			// Swap out the page
-			swap_out_page(pages[i].as, pages[i].vpn, free_paddr + i * PAGE_SIZE);
-			// Free coremap entry
-			pages[i].flags = 0;
+			return mm;
 		}
 	}
-	lock_release(core_map_lock);
+	return NULL;
 }
 
-void evict_all_user_pages()
+/*
+ * The file and offset the page of 'as' at 'vpn' is cached by, or NULL if
+ * it isn't shared through the page cache. Read only pages of the
+ * executable's text segment and pages of MAP_SHARED file mappings are.
+ * '*shared' is set for the latter.
+ */
+static struct vnode* page_cache_key(struct addrspace *as, vaddr_t vpn, off_t *offset, int *shared)
 {
-	lock_acquire(core_map_lock);
+	struct vm_mapping *mm;
 
-	int i;
-	for(i = 0; i < num_pages; ++i)
+	if(as->as_vnode != NULL && vpn_is_executable(as, vpn) &&
+			!(elf_region_flags(as, vpn) & PF_W))
 	{
-		// 'as' is non NULL for user pages
-		if(pages[i].as != NULL && (pages[i].flags & PFLAG_USED_MASK))
-		{
-			// Is this vpn an executable page? In that case let the page table finder
-			// know. He will not evict this page table
-			int is_executable = (pages[i].vpn >= pages[i].as->as_vbase1) &&
-					(pages[i].vpn < (pages[i].as->as_vbase1 + pages[i].as->as_npages1 * PAGE_SIZE));
-
-			// Get this user's pages table for this vpn
-			struct page_table *pgtbl = get_ptbl(pages[i].as, pages[i].vpn, is_executable);
-			int page_index = (pages[i].vpn & PGTBL_INDEX) >> 12;
-			// His page mappping is not invalid
-			pgtbl[page_index].pg_tbl_entry &= ~PGTBL_VALID_MASK;
-			// Swap out the page
-			swap_out_page(pages[i].as, pages[i].vpn, free_paddr + i * PAGE_SIZE);
-			// Free coremap entry
-			pages[i].flags = 0;
-		}
+		vaddr_t exec_vbase = (as->as_flags1 & PF_X) ? as->as_vbase1 : as->as_vbase2;
+		*offset = as->executable_offset + (vpn - exec_vbase);
+		*shared = 0;
+		return as->as_vnode;
+	}
+	mm = mapping_find(as, vpn);
+	if(mm != NULL && mm->mm_flags == MAP_SHARED)
+	{
+		*offset = mm->mm_offset + (vpn - mm->mm_start);
+		*shared = 1;
+		return mm->mm_vnode;
 	}
+	return NULL;
+}
 
-	lock_release(core_map_lock);
+static int page_is_cacheable(struct addrspace *as, vaddr_t vpn)
+{
+	off_t offset;
+	int shared;
+	return page_cache_key(as, vpn, &offset, &shared) != NULL;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Hash bucket for a file page
+ */
+static int page_cache_bucket(struct vnode *v, off_t offset)
 {
-	paddr_t pa;
+	return ((((u_int32_t)v) >> 4) ^ (offset >> 12)) % PAGE_CACHE_BUCKETS;
+}
 
-	// First attempt to steal the ram directly
-	pa = getppages(npages);
+/*
+ * Core map index of the cached page 'as' would have at 'vpn', or -1. The
+ * page may be at another address in the address space that has it.
+ */
+static int page_cache_lookup(struct addrspace *as, vaddr_t vpn)
+{
+	struct vnode *v, *cv;
+	off_t offset, coffset;
+	int shared, cshared, i;
 
-	if (pa != 0) {
-		return PADDR_TO_KVADDR(pa);
+	v = page_cache_key(as, vpn, &offset, &shared);
+	assert(v != NULL);
+	for(i = page_cache[page_cache_bucket(v, offset)]; i != -1; i = pages[i].cache_next)
+	{
+		cv = page_cache_key(pages[i].as, pages[i].vpn, &coffset, &cshared);
+		// Writes to a shared mapping have to reach the file, so it
+		// doesn't pick up text pages and the other way round
+		if(cv == v && coffset == offset && cshared == shared)
+		{
+			return i;
+		}
 	}
+	return -1;
+}
 
-	// ram_stealmem failed. This means our virtual memory system is alive. We will need to request
-	// a page from him then.
-	pa = getkpagesfromvm(npages);
-
-	if(pa != 0)
+/*
+ * Add the page in core map entry 'index' to the cache. Its address space
+ * must be set.
+ */
+static void page_cache_insert(int index)
+{
+	struct vnode *v;
+	off_t offset;
+	int shared, bucket;
+
+	v = page_cache_key(pages[index].as, pages[index].vpn, &offset, &shared);
+	assert(v != NULL);
+	assert(!(pages[index].flags & PFLAG_CACHED));
+	bucket = page_cache_bucket(v, offset);
+	pages[index].flags |= PFLAG_CACHED;
+	if(shared)
 	{
-		return PADDR_TO_KVADDR(pa);
+		pages[index].flags |= PFLAG_FILE_SHARED;
 	}
+	pages[index].cache_next = page_cache[bucket];
+	page_cache[bucket] = index;
+}
 
-	// Our vm couldn't allocate pages for us. One reason may be that too much memory is being taken
-	// by user pages. Evict all user pages and try again
-	evict_all_user_pages();
-	// One last attempt
-	pa = getkpagesfromvm(npages);
-
-	if(pa != 0)
+static void page_cache_remove(int index)
+{
+	struct vnode *v;
+	off_t offset;
+	int shared;
+
+	v = page_cache_key(pages[index].as, pages[index].vpn, &offset, &shared);
+	assert(v != NULL);
+	int *link = &page_cache[page_cache_bucket(v, offset)];
+	while(*link != index)
 	{
-		return PADDR_TO_KVADDR(pa);
+		assert(*link != -1);
+		link = &pages[*link].cache_next;
 	}
+	*link = pages[index].cache_next;
+	pages[index].flags &= ~PFLAG_CACHED;
+}
 
+/*
+ * If somebody else has the page of 'as' at 'vpn' in the page cache, map
+ * it at 'pte' too and return 1. Text pages are read only, shared file pages
+ * get 'flags'. The core map must be locked.
+ */
+static int page_cache_map(struct addrspace *as, vaddr_t vpn, struct page_table *pte, int32_t flags)
+{
+	int i;
 
-	return 0;
+	if(!page_is_cacheable(as, vpn) || (i = page_cache_lookup(as, vpn)) == -1)
+	{
+		return 0;
+	}
+	pages[i].refcount++;
+	pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_COW_MASK | PGTBL_MOD_MASK);
+	pte->pg_tbl_entry |= (free_paddr + i * PAGE_SIZE) | flags | PGTBL_VALID_MASK;
+	VMSTAT_ADD(as, vs_page_cache_hits, 1);
+	return 1;
 }
 
-void 
-free_kpages(vaddr_t addr)
+/*
+ * Does 'as' hold an ASID from the current generation? If not, none of its
+ * entries can be in the TLB.
+ */
+static int as_has_asid(struct addrspace *as)
 {
-	vaddr_t coremap_start = PADDR_TO_KVADDR(free_paddr);
-	int page_index = (addr - coremap_start) / PAGE_SIZE;
+	return as->as_asid_gen == asid_generation;
+}
 
-	// These assertions are to check to make sure we are trying
-	// to free the address for a valid page that was actually
-	// allocated to the kernel
-	assert(page_index >= 0 && page_index < num_pages);
+/*
+ * Invalidate the TLB entry of 'as' for 'vpn' if there is one
+ */
+static void tlb_invalidate_vpn(struct addrspace *as, vaddr_t vpn)
+{
 	int spl = splhigh();
-	int num_contiguous_pages = pages[page_index].flags & PFLAG_NUM_CONTG_PAGES;
-	assert((page_index + num_contiguous_pages) <= num_pages);
-	assert(pages[page_index].as == NULL && (pages[page_index].flags & PFLAG_USED_MASK));
-//	kprintf("Freed page at address 0x%x\n", addr & 0x7fffffff);
-	// Now free the pages
-
-	int i;
-	for(i = 0; i < num_contiguous_pages; ++i)
+	if(as_has_asid(as))
 	{
-		pages[page_index + i].flags = 0;
+		int i = TLB_Probe(vpn | (as->as_asid << TLBHI_PIDSHIFT), 0);
+		if(i >= 0)
+		{
+			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
 	}
 	splx(spl);
 }
 
-// Macro to take the absolute difference of two unsigned numbers
-#define UNSIGNED_DIFF(a,b) (((a) > (b)) ? (a-b) : (b-a))
-
-// -------------------------------------------------------------------------------------------------------------
 /*
- * Doesn't do a lot now but will be used during swapping
+ * Invalidate all the TLB entries of 'as'
  */
-paddr_t
-make_pg_available(struct addrspace *as, vaddr_t vpn, int *free_index)
+static void tlb_flush_asid(struct addrspace *as)
 {
-	// The policy we will use here is we will try to evict a page that is in
+	int i, spl;
+	u_int32_t ehi, elo;
+
+	spl = splhigh();
+	if(as_has_asid(as))
+	{
+		for(i = 0; i < NUM_TLB; ++i)
+		{
+			TLB_Read(&ehi, &elo, i);
+			// Invalid entries are in kseg0 and can carry any PID
+			if((ehi & TLBHI_VPAGE) < MIPS_KSEG0 &&
+					(ehi & TLBHI_PID) == (as->as_asid << TLBHI_PIDSHIFT))
+			{
+				TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Invalidate every TLB entry mapping the frame at 'page_addr', whoever it
+ * belongs to
+ */
+static void tlb_invalidate_frame(paddr_t page_addr)
+{
+	int i, spl;
+	u_int32_t ehi, elo;
+
+	spl = splhigh();
+	for(i = 0; i < NUM_TLB; ++i)
+	{
+		TLB_Read(&ehi, &elo, i);
+		if((elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) == page_addr)
+		{
+			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+	}
+	splx(spl);
+}
+
+static void tlb_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Enter a mapping in the TLB. Replaces the entry for the same page if there
+ * is one, else takes a free slot, else a random one.
+ */
+static void tlb_load(u_int32_t ehi, u_int32_t elo)
+{
+	int i, spl;
+	u_int32_t ehi_old, elo_old;
+
+	spl = splhigh();
+	i = TLB_Probe(ehi, 0);
+	if(i < 0)
+	{
+		for(i = 0; i < NUM_TLB; ++i)
+		{
+			TLB_Read(&ehi_old, &elo_old, i);
+			if(!(elo_old & TLBLO_VALID))
+			{
+				break;
+			}
+		}
+	}
+	if(i < NUM_TLB)
+	{
+		TLB_Write(ehi, elo, i);
+	}
+	else
+	{
+		TLB_Random(ehi, elo);
+	}
+	splx(spl);
+}
+
+/*
+ * The next address after 'after' where 'sharer' could have the user page
+ * in core map entry 'index' mapped, or 0 if there are no more. Sharers
+ * have a frame at the same address as its owner, except for pages of
+ * shared file mappings, which can be mapped anywhere (more than once).
+ * Start with 'after' 0.
+ */
+static vaddr_t frame_vpn_in(struct addrspace *sharer, int index, vaddr_t after)
+{
+	struct vm_mapping *mm, *owner_mm;
+	vaddr_t v;
+	off_t offset;
+
+	if(!(pages[index].flags & PFLAG_FILE_SHARED))
+	{
+		return (after < pages[index].vpn) ? pages[index].vpn : 0;
+	}
+
+	owner_mm = mapping_find(pages[index].as, pages[index].vpn);
+	assert(owner_mm != NULL);
+	offset = owner_mm->mm_offset + (pages[index].vpn - owner_mm->mm_start);
+	for(mm = sharer->as_mmaps; mm != NULL; mm = mm->mm_next)
+	{
+		if(mm->mm_flags != MAP_SHARED || mm->mm_vnode != owner_mm->mm_vnode ||
+				offset < mm->mm_offset ||
+				offset >= mm->mm_offset + (off_t)(mm->mm_npages * PAGE_SIZE))
+		{
+			continue;
+		}
+		v = mm->mm_start + (offset - mm->mm_offset);
+		if(v > after)
+		{
+			return v;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the shared file page in core map entry 'index' back to its file.
+ * Only the part of the page inside the file is written, mappings don't
+ * make files grow. The core map must be locked, and nobody may be able to
+ * write the page (VOP_WRITE sleeps, a write meanwhile would be lost).
+ * Returns the error from VOP_WRITE.
+ */
+static int mapping_write_page(int index)
+{
+	struct vm_mapping *mm = mapping_find(pages[index].as, pages[index].vpn);
+	struct stat st;
+	struct uio u;
+	off_t pos;
+	size_t len = PAGE_SIZE;
+	int result;
+
+	assert(lock_do_i_hold(core_map_lock));
+	assert(mm != NULL);
+	pos = mm->mm_offset + (pages[index].vpn - mm->mm_start);
+	if(VOP_STAT(mm->mm_vnode, &st) == 0)
+	{
+		if(st.st_size <= pos)
+		{
+			return 0;
+		}
+		if(st.st_size - pos < (off_t)len)
+		{
+			len = st.st_size - pos;
+		}
+	}
+	mk_kuio(&u, (void*)PADDR_TO_KVADDR(free_paddr + index * PAGE_SIZE), len, pos, UIO_WRITE);
+	result = VOP_WRITE(mm->mm_vnode, &u);
+	if(result)
+	{
+		kprintf("vm: Error writing back a page of a mapped file\n");
+		return result;
+	}
+	VMSTAT_ADD(pages[index].as, vs_mmap_writes, 1);
+	return 0;
+}
+
+/*
+ * Read the page of 'mm' at 'vpn' from its file into the frame at
+ * 'page_addr'. The part of the page past the end of the file reads as zeros.
+ */
+static void mapping_read_page(struct vm_mapping *mm, vaddr_t vpn, paddr_t page_addr)
+{
+	struct uio u;
+	off_t pos = mm->mm_offset + (vpn - mm->mm_start);
+
+	mk_kuio(&u, (void*)PADDR_TO_KVADDR(page_addr), PAGE_SIZE, pos, UIO_READ);
+	if(VOP_READ(mm->mm_vnode, &u))
+	{
+		kprintf("vm: Error reading a page of a mapped file\n");
+		u.uio_resid = PAGE_SIZE;
+	}
+	bzero((void*)PADDR_TO_KVADDR(page_addr + PAGE_SIZE - u.uio_resid), u.uio_resid);
+}
+
+/*
+ * Drop the reference 'as' has on a user frame. The caller must have taken
+ * the frame out of the page table entry it was released from already. The
+ * frame is freed when the last sharer lets go (shared file pages are
+ * written back first if they need to be). If 'as' was the sharer recorded
+ * in the core map, the frame is handed over to one of the remaining sharers.
+ */
+static void release_frame(struct addrspace *as, int index)
+{
+	assert(lock_do_i_hold(core_map_lock));
+	assert(pages[index].refcount > 0);
+
+	pages[index].refcount--;
+	if(pages[index].refcount == 0)
+	{
+		if((pages[index].flags & PFLAG_FILE_SHARED) && (pages[index].flags & PFLAG_DIRTY))
+		{
+			mapping_write_page(index);
+		}
+		if(pages[index].swap_slot != PAGE_NO_SWAP_SLOT)
+		{
+			swap_free_slot(pages[index].swap_slot);
+		}
+		coremap_free_run(index, 1);
+		return;
+	}
+
+	if(pages[index].as != as)
+	{
+		return;
+	}
+
+	paddr_t page_addr = free_paddr + index * PAGE_SIZE;
+	struct addrspace *sharer;
+	vaddr_t v;
+	for(sharer = as_list; sharer != NULL; sharer = sharer->as_next)
+	{
+		for(v = frame_vpn_in(sharer, index, 0); v != 0; v = frame_vpn_in(sharer, index, v))
+		{
+			struct page_table *pte = lookup_pte(sharer, v);
+			if(pte != NULL && (pte->pg_tbl_entry & PGTBL_VALID_MASK) &&
+					(pte->pg_tbl_entry & PAGE_FRAME) == page_addr)
+			{
+				// The page cache finds it by the new owner now, so it
+				// stays in the same bucket
+				pages[index].as = sharer;
+				pages[index].vpn = v;
+				return;
+			}
+		}
+	}
+	panic("Shared frame 0x%x has no other sharer!\n", page_addr);
+}
+
+/*
+ * Point every page table entry mapping the user page in core map entry
+ * 'index' at swap section 'slot', or mark it not loaded if there is no slot,
+ * and drop it from the TLB. The frame itself is left for the caller to free.
+ */
+static void unmap_user_page(int index, int32_t slot)
+{
+	paddr_t page_addr = free_paddr + index * PAGE_SIZE;
+	int32_t sharers = 0;
+	vaddr_t vpn;
+
+	struct addrspace *sharer;
+	for(sharer = as_list; sharer != NULL; sharer = sharer->as_next)
+	{
+		for(vpn = frame_vpn_in(sharer, index, 0); vpn != 0; vpn = frame_vpn_in(sharer, index, vpn))
+		{
+			struct page_table *pte = lookup_pte(sharer, vpn);
+			if(pte == NULL || !(pte->pg_tbl_entry & PGTBL_VALID_MASK) ||
+					(pte->pg_tbl_entry & PAGE_FRAME) != page_addr)
+			{
+				continue;
+			}
+			pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_VALID_MASK | PGTBL_COW_MASK | PGTBL_MOD_MASK);
+			tlb_invalidate_vpn(sharer, vpn);
+			if(slot != PAGE_NO_SWAP_SLOT)
+			{
+				pte->pg_tbl_entry |= PGTBL_MK_SWAP_SLOT(slot);
+				// The first sharer takes over the page's reference
+				if(sharers > 0)
+				{
+					swap_share_slot(slot);
+				}
+			}
+			else
+			{
+				// Not loaded anymore. The next fault loads it from the
+				// executable or the mapped file, or zero fills it
+				pte->pg_tbl_entry &= ~PF_L;
+			}
+			sharers++;
+		}
+	}
+	assert(sharers == pages[index].refcount);
+
+	VMSTAT_ADD(pages[index].as, vs_evictions, 1);
+}
+
+/*
+ * Evict the user page in core map entry 'index'. Every address space sharing
+ * the frame gets its page table entry pointed at one swap section holding the
+ * page. Only dirty pages are written. A clean page either still has its copy
+ * in swap, or is loaded again from the executable (or zero filled) on the next
+ * fault. Pages of shared file mappings go back to their file instead.
+ */
+static void evict_page(int index)
+{
+	assert(lock_do_i_hold(core_map_lock));
+	assert(pages[index].flags & PFLAG_USED_MASK);
+	assert(pages[index].as != NULL);
+
+	paddr_t page_addr = free_paddr + index * PAGE_SIZE;
+	int should_i_swap_out = (pages[index].flags & PFLAG_DIRTY) != 0;
+	int32_t slot = pages[index].swap_slot;
+
+	if(pages[index].flags & PFLAG_FILE_SHARED)
+	{
+		// Unmap it before writing, so nobody can write to it while
+		// VOP_WRITE sleeps. There is nowhere else to keep the page, so a
+		// failed write loses it (mapping_write_page complains)
+		unmap_user_page(index, PAGE_NO_SWAP_SLOT);
+		if(should_i_swap_out)
+		{
+			mapping_write_page(index);
+		}
+		coremap_free_run(index, 1);
+		return;
+	}
+
+	if(should_i_swap_out)
+	{
+		// Any copy we had in swap is stale
+		if(slot != PAGE_NO_SWAP_SLOT)
+		{
+			swap_free_slot(slot);
+		}
+		slot = swap_reserve_slot();
+	}
+
+	unmap_user_page(index, slot);
+
+	if(should_i_swap_out)
+	{
+		int writes = swap_write_page(slot, page_addr);
+		VMSTAT_ADD(pages[index].as, vs_swap_outs, 1);
+		VMSTAT_ADD(pages[index].as, vs_swap_writes, writes);
+	}
+
+	// Set core map entry to free
+	coremap_free_run(index, 1);
+}
+
+/*
+ * Core map index of the page 'as' has in memory at 'vpn', or -1
+ */
+static int resident_page_index(struct addrspace *as, vaddr_t vpn)
+{
+	struct page_table *pte = lookup_pte(as, vpn);
+	if(pte == NULL || !(pte->pg_tbl_entry & PGTBL_VALID_MASK))
+	{
+		return -1;
+	}
+	return ((pte->pg_tbl_entry & PAGE_FRAME) - free_paddr) / PAGE_SIZE;
+}
+
+/*
+ * Can the user page in core map entry 'index' go out in the same cluster as
+ * a dirty page of 'as' being evicted? Only private dirty pages that haven't
+ * been used since the clock last passed them.
+ */
+static int page_can_cluster(int index, struct addrspace *as)
+{
+	return index != -1 && (pages[index].flags & PFLAG_USED_MASK) &&
+			!(pages[index].flags & PFLAG_FILE_SHARED) &&
+			pages[index].as == as && pages[index].refcount == 1 &&
+			(pages[index].flags & PFLAG_DIRTY) && !(pages[index].flags & PFLAG_REFERENCED);
+}
+
+/*
+ * Evict the user page in core map entry 'index'. If it has to be written,
+ * the dirty unreferenced pages around it in the same address space (and page
+ * table) are evicted along with it. They get adjacent swap sections in
+ * address order and go out with one disk request, and swap-in reads them
+ * back together (see swap_in_readahead).
+ */
+static void evict_page_clustered(int index)
+{
+	struct addrspace *as = pages[index].as;
+	vaddr_t vpn = pages[index].vpn;
+	vaddr_t v, start;
+	int cluster[SWAP_CLUSTER_MAX];
+	paddr_t cluster_addrs[SWAP_CLUSTER_MAX];
+	int n, i, got, victim_pos, base, writes;
+	u_int32_t first;
+
+	assert(lock_do_i_hold(core_map_lock));
+
+	if(swap_cluster_pages <= 1 || !page_can_cluster(index, as) ||
+			resident_page_index(as, vpn) != index)
+	{
+		evict_page(index);
+		return;
+	}
+
+	// Back up over neighbours that can come along, without leaving
+	// this page table
+	start = vpn;
+	for(n = 1; n < swap_cluster_pages; ++n)
+	{
+		v = start - PAGE_SIZE;
+		if(v > start || (v >> 22) != (vpn >> 22) ||
+				!page_can_cluster(resident_page_index(as, v), as))
+		{
+			break;
+		}
+		start = v;
+	}
+
+	// Then gather the run from there on up
+	victim_pos = (vpn - start) / PAGE_SIZE;
+	for(n = 0, v = start; n < swap_cluster_pages && (v >> 22) == (vpn >> 22); ++n, v += PAGE_SIZE)
+	{
+		i = resident_page_index(as, v);
+		if(!page_can_cluster(i, as))
+		{
+			break;
+		}
+		cluster[n] = i;
+	}
+	assert(n > victim_pos);
+
+	// Whatever doesn't fit in the free sections we got stays in memory.
+	// Keep the window around the page we were asked to evict
+	got = swap_reserve_cluster(n, &first);
+	base = (victim_pos >= got) ? victim_pos - got + 1 : 0;
+
+	for(i = 0; i < got; ++i)
+	{
+		int ci = cluster[base + i];
+		// Any copy we had in swap is stale
+		if(pages[ci].swap_slot != PAGE_NO_SWAP_SLOT)
+		{
+			swap_free_slot(pages[ci].swap_slot);
+		}
+		unmap_user_page(ci, first + i);
+		cluster_addrs[i] = free_paddr + ci * PAGE_SIZE;
+	}
+
+	writes = swap_write_cluster(first, cluster_addrs, got);
+	VMSTAT_ADD(as, vs_swap_outs, got);
+	VMSTAT_ADD(as, vs_swap_writes, writes);
+
+	for(i = 0; i < got; ++i)
+	{
+		coremap_free_run(cluster[base + i], 1);
+	}
+}
+
+// Called by kernel when finished executing user program. This is to prevent
+// any leaks
+void reclaim_all_user_pages()
+{
+	int spl = splhigh();
+	int i;
+	for(i = 0; i < num_pages; ++i)
+	{
+		if(pages[i].as != NULL && (pages[i].flags & PFLAG_USED_MASK))
+		{
+			// The address spaces may be gone. Empty the cache wholesale
+			pages[i].flags &= ~PFLAG_CACHED;
+			coremap_free_run(i, 1);
+		}
+	}
+	for(i = 0; i < PAGE_CACHE_BUCKETS; ++i)
+	{
+		page_cache[i] = -1;
+	}
+	// Nobody maps the zero page anymore
+	pages[(zero_page - free_paddr) / PAGE_SIZE].refcount = 1;
+	splx(spl);
+}
+
+/*
+ * Get one frame for the kernel. If none are free, evict a user page (the
+ * clock's pick, whatever the replacement policy) or failing that a page
+ * table. 0 if all that is left is kernel memory.
+ */
+static paddr_t getkpage_evicting(void)
+{
+	paddr_t addr = 0;
+	int i, victim;
+
+	lock_acquire(core_map_lock);
+	while((i = coremap_alloc_run(1)) == -1)
+	{
+		victim = clock_find_victim();
+		if(victim == -1)
+		{
+			if(!reclaim_page_table())
+			{
+				break;
+			}
+		}
+		else if(pages[victim].flags & PFLAG_USED_MASK)
+		{
+			evict_page_clustered(victim);
+			vmstats.vs_clock_evictions++;
+		}
+	}
+	if(i != -1)
+	{
+		setup_coremap_for_kpages(pages + i, 1);
+		pages[i].flags |= 1;
+		addr = free_paddr + i * PAGE_SIZE;
+	}
+	lock_release(core_map_lock);
+
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	// First attempt to steal the ram directly
+	pa = getppages(npages);
+
+	if (pa != 0) {
+		return PADDR_TO_KVADDR(pa);
+	}
+
+	// ram_stealmem failed. This means our virtual memory system is alive. We will need to request
+	// a page from him then.
+	pa = getkpagesfromvm(npages);
+
+	if(pa != 0)
+	{
+		return PADDR_TO_KVADDR(pa);
+	}
+
+	// Our vm couldn't allocate pages for us. Take back what the object caches and the
+	// kmalloc magazines are holding on to
+	slab_reap();
+	kheap_drain();
+
+	// A single page can still be had by evicting a user page. A longer run is
+	// not worth evicting everybody for; big kmallocs don't need one (see
+	// alloc_kvpages)
+	if(npages == 1)
+	{
+		pa = getkpage_evicting();
+	}
+	else
+	{
+		pa = getkpagesfromvm(npages);
+	}
+
+	if(pa != 0)
+	{
+		return PADDR_TO_KVADDR(pa);
+	}
+
+	return 0;
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	vaddr_t coremap_start = PADDR_TO_KVADDR(free_paddr);
+	int page_index = (addr - coremap_start) / PAGE_SIZE;
+
+	// These assertions are to check to make sure we are trying
+	// to free the address for a valid page that was actually
+	// allocated to the kernel
+	assert(page_index >= 0 && page_index < num_pages);
+	int spl = splhigh();
+	int num_contiguous_pages = pages[page_index].flags & PFLAG_NUM_CONTG_PAGES;
+	assert((page_index + num_contiguous_pages) <= num_pages);
+	assert(pages[page_index].as == NULL && (pages[page_index].flags & PFLAG_USED_MASK));
+//	kprintf("Freed page at address 0x%x\n", addr & 0x7fffffff);
+	// Now free the pages
+	coremap_free_run(page_index, num_contiguous_pages);
+	splx(spl);
+}
+
+/*
+ * Kernel virtual memory. kmallocs of more than a page get kseg2 addresses
+ * backed by frames taken one at a time, so they don't need a physically
+ * contiguous run. kva_ptes[] holds the frame of each kseg2 page (with
+ * TLBLO_VALID set, or KVA_RESERVED while alloc_kvpages is still getting
+ * frames) and kva_npages[] the length of each range, at its first page.
+ *
+ * kseg2 misses come through vm_fault, which loads a global TLB entry
+ * from kva_ptes[] without taking any locks. So the VM code itself can
+ * use kseg2 memory, but the UTLB refill path can't (the page directory
+ * and the core map stay in kseg0) and neither can kernel stacks.
+ */
+#define KVA_PAGES	512
+#define KVA_RESERVED	1
+
+static u_int32_t kva_ptes[KVA_PAGES];
+static u_int16_t kva_npages[KVA_PAGES];
+static int kva_used_pages = 0;
+
+/*
+ * Free the frames of kseg2 pages 'first' to 'first' + 'npages' - 1 and
+ * unmap them. At splhigh.
+ */
+static void kva_unmap(int first, int npages)
+{
+	vaddr_t vaddr;
+	int i, j;
+
+	for(i = first; i < first + npages; ++i)
+	{
+		vaddr = MIPS_KSEG2 + i * PAGE_SIZE;
+		j = TLB_Probe(vaddr, 0);
+		if(j >= 0)
+		{
+			TLB_Write(TLBHI_INVALID(j), TLBLO_INVALID(), j);
+		}
+		if(kva_ptes[i] & TLBLO_VALID)
+		{
+			free_kpages(PADDR_TO_KVADDR(kva_ptes[i] & TLBLO_PPAGE));
+		}
+		kva_ptes[i] = 0;
+	}
+}
+
+vaddr_t
+alloc_kvpages(int npages)
+{
+	paddr_t pa;
+	int first, i, spl;
+
+	// Before the VM is up there is only ram_stealmem, which is contiguous
+	if(pages == NULL)
+	{
+		return alloc_kpages(npages);
+	}
+
+	spl = splhigh();
+
+	// First fit
+	for(first = 0; first + npages <= KVA_PAGES; first = i + 1)
+	{
+		for(i = first; i < first + npages && kva_ptes[i] == 0; ++i)
+			;
+		if(i == first + npages)
+		{
+			break;
+		}
+	}
+	if(first + npages > KVA_PAGES)
+	{
+		splx(spl);
+		return 0;
+	}
+	for(i = first; i < first + npages; ++i)
+	{
+		kva_ptes[i] = KVA_RESERVED;
+	}
+
+	// Getting frames may sleep. The range is ours already
+	for(i = first; i < first + npages; ++i)
+	{
+		pa = getkpage_evicting();
+		if(pa == 0)
+		{
+			kva_unmap(first, npages);
+			splx(spl);
+			return 0;
+		}
+		kva_ptes[i] = pa | TLBLO_VALID;
+	}
+	kva_npages[first] = npages;
+	kva_used_pages += npages;
+
+	splx(spl);
+	return MIPS_KSEG2 + first * PAGE_SIZE;
+}
+
+void
+free_kvpages(vaddr_t addr)
+{
+	int first, spl;
+
+	assert(addr >= MIPS_KSEG2 && addr % PAGE_SIZE == 0);
+	first = (addr - MIPS_KSEG2) / PAGE_SIZE;
+	assert(first < KVA_PAGES);
+
+	spl = splhigh();
+	assert(kva_npages[first] > 0);
+	kva_used_pages -= kva_npages[first];
+	kva_unmap(first, kva_npages[first]);
+	kva_npages[first] = 0;
+	splx(spl);
+}
+
+/*
+ * TLB miss on a kseg2 address. The entry is global, so it is good whatever
+ * address space is active. At splhigh.
+ */
+static int kva_fault(vaddr_t faultaddress)
+{
+	u_int32_t i = (faultaddress - MIPS_KSEG2) / PAGE_SIZE;
+
+	if(i >= KVA_PAGES || !(kva_ptes[i] & TLBLO_VALID))
+	{
+		return EFAULT;
+	}
+	TLB_Random(faultaddress, kva_ptes[i] | TLBLO_DIRTY | TLBLO_GLOBAL);
+	return VM_FAULT_OK;
+}
+
+// Macro to take the absolute difference of two unsigned numbers
+#define UNSIGNED_DIFF(a,b) (((a) > (b)) ? (a-b) : (b-a))
+
+// -------------------------------------------------------------------------------------------------------------
+/*
+ * Can the user page in core map entry 'index' be dropped without writing
+ * it anywhere?
+ */
+static int page_is_clean(int index)
+{
+	return !(pages[index].flags & PFLAG_DIRTY);
+}
+
+/*
+ * Note a write to the user page mapped by 'pte'. From now on the TLB may map
+ * it writable.
+ */
+static void page_dirtied(struct page_table *pte)
+{
+	int index = ((pte->pg_tbl_entry & PAGE_FRAME) - free_paddr) / PAGE_SIZE;
+	assert(index >= 0 && index < num_pages);
+	pte->pg_tbl_entry |= PGTBL_MOD_MASK;
+	// Any swap copy is now stale. It is let go when the page is evicted or freed
+	pages[index].flags |= PFLAG_DIRTY;
+}
+
+/*
+ * page_dirtied for a write fault by 'as' on 'vpn'. A shared file page may
+ * be in the middle of being written back, with write access taken away
+ * and the core map held across VOP_WRITE (as_msync). Wait for that to
+ * finish so the page doesn't change while the file gets a copy of it.
+ * Returns the page table entry, or NULL if the page changed under us
+ * while we waited. The faulting instruction should then just be retried.
+ */
+static struct page_table *page_dirtied_fault(struct addrspace *as, vaddr_t vpn, struct page_table *pte)
+{
+	paddr_t page_addr = pte->pg_tbl_entry & PAGE_FRAME;
+	int index = (page_addr - free_paddr) / PAGE_SIZE;
+
+	if(!(pages[index].flags & PFLAG_FILE_SHARED))
+	{
+		page_dirtied(pte);
+		return pte;
+	}
+
+	lock_acquire(core_map_lock);
+	pte = lookup_pte(as, vpn);
+	if(pte == NULL || !(pte->pg_tbl_entry & PGTBL_VALID_MASK) ||
+			(pte->pg_tbl_entry & PAGE_FRAME) != page_addr)
+	{
+		lock_release(core_map_lock);
+		return NULL;
+	}
+	page_dirtied(pte);
+	lock_release(core_map_lock);
+	return pte;
+}
+
+/*
+ * Record that the user page at 'page_addr' has been used. Called whenever
+ * it is entered in the TLB.
+ */
+static void page_referenced(paddr_t page_addr)
+{
+	int index = (page_addr - free_paddr) / PAGE_SIZE;
+	assert(index >= 0 && index < num_pages);
+	pages[index].flags |= PFLAG_REFERENCED;
+}
+
+/*
+ * Clock replacement. The hand sweeps the core map. A referenced page gets
+ * a second chance: its reference bit is cleared and its TLB entries are
+ * dropped, so the next access faults and sets it again. Unreferenced pages
+ * that can be dropped without a write are taken first. A dirty one is only
+ * taken once a full sweep has found no clean page.
+ *
+ * Returns a core map index (which may be a frame somebody freed while we
+ * slept) or -1 if there are no user pages at all.
+ */
+static int clock_find_victim(void)
+{
+	int scanned, i;
+	int dirty_victim = -1;
+
+	for(scanned = 0; scanned < 2 * num_pages; ++scanned)
+	{
+		i = clock_hand;
+		clock_hand = (clock_hand + 1) % num_pages;
+
+		if(!(pages[i].flags & PFLAG_USED_MASK))
+		{
+			return i;
+		}
+		if(pages[i].as == NULL || (pages[i].flags & PFLAG_PAGE_TABLE))
+		{
+			// Kernel page, page table or a frame that is being filled
+			continue;
+		}
+		if(pages[i].flags & PFLAG_REFERENCED)
+		{
+			pages[i].flags &= ~PFLAG_REFERENCED;
+			tlb_invalidate_frame(free_paddr + i * PAGE_SIZE);
+			vmstats.vs_ref_clears++;
+			continue;
+		}
+		if(page_is_clean(i))
+		{
+			return i;
+		}
+		if(dirty_victim == -1)
+		{
+			dirty_victim = i;
+		}
+		if(scanned + 1 >= num_pages)
+		{
+			return dirty_victim;
+		}
+	}
+	return dirty_victim;
+}
+
+/*
+ * Called when there are no free frames. Evicts a page to free one.
+ */
+void
+make_pg_available(struct addrspace *as, vaddr_t vpn)
+{
+	if(vm_replace_policy == VM_POLICY_CLOCK)
+	{
+		int victim;
+		while((victim = clock_find_victim()) == -1)
+		{
+			// No user pages left at all. Give up a page table
+			if(reclaim_page_table())
+			{
+				return;
+			}
+			lock_release(core_map_lock);
+			thread_yield();
+			lock_acquire(core_map_lock);
+		}
+		if(pages[victim].flags & PFLAG_USED_MASK)
+		{
+			evict_page_clustered(victim);
+			vmstats.vs_clock_evictions++;
+		}
+		return;
+	}
+
+	// The policy we will use here is we will try to evict a page that is in
 	// the same region (code, data or stack) as the faulting vpn and farthest
 	// away for it within that region. This is kind of a locality thing.
 
@@ -355,18 +1559,6 @@ make_pg_available(struct addrspace *as, vaddr_t vpn, int *free_index)
 
 	// Figure out which region we belong to
 	vaddr_t vbase = 0, vtop = 0;
-	vaddr_t executable_vbase, executable_vtop;
-	if(as->as_flags1 & PF_X)
-	{
-		executable_vbase = as->as_vbase1;
-		executable_vtop = as->as_vbase1 + (as->as_npages1 * PAGE_SIZE);
-	}
-	else
-	{
-		executable_vbase = as->as_vbase2;
-		executable_vtop = as->as_vbase2 + (as->as_npages2 * PAGE_SIZE);;
-
-	}
 	if(as->as_vbase1 <= vpn && vpn < (as->as_vbase1 + (as->as_npages1 * PAGE_SIZE)))
 	{
 		vbase = as->as_vbase1;
@@ -389,7 +1581,7 @@ make_pg_available(struct addrspace *as, vaddr_t vpn, int *free_index)
 	}
 	else
 	{
-		panic("Segmentation fault?! This should have already been handled in vm_fault()!\n");
+		// Making room for a page table rather than a page. Any region will do
 	}
 
 	int victim_index;
@@ -453,560 +1645,1093 @@ make_pg_available(struct addrspace *as, vaddr_t vpn, int *free_index)
 		}
 	}
 
-	if(max_diff_index != -1)
+	if(max_diff_index != -1)
+	{
+		victim_index = max_diff_index;
+	}
+	else
+	{
+		victim_index = alternate_index;
+	}
+#endif
+
+//#if 0
+	while(1)
+	{
+		int i_start = random() % num_pages;
+		int i;
+		victim_index = -1;
+		for(i = i_start; i < num_pages; ++i)
+		{
+			if(!(pages[i].flags & PFLAG_USED_MASK))
+			{
+				victim_index = i;
+				should_i_swap_out = 0;
+				break;
+			}
+			else if(pages[i].as == as && !(pages[i].flags & PFLAG_PAGE_TABLE))
+			{
+				victim_index = i;
+				break;
+			}
+		}
+		if(victim_index == -1)
+		{
+			for(i = i_start; i >= 0; --i)
+			{
+				if(!(pages[i].flags & PFLAG_USED_MASK))
+				{
+					victim_index = i;
+					should_i_swap_out = 0;
+					break;
+				}
+				else if(pages[i].as == as && !(pages[i].flags & PFLAG_PAGE_TABLE))
+				{
+					victim_index = i;
+					break;
+				}
+			}
+		}
+
+		if(victim_index == -1)
+		{
+			if(reclaim_page_table())
+			{
+				return;
+			}
+			lock_release(core_map_lock);
+			thread_yield();
+			lock_acquire(core_map_lock);
+		}
+		else
+		{
+			break;
+		}
+	}
+//#endif
+
+	// We have our victim. Swap him out (this removes the valid bit in the
+	// page table entry of everybody sharing it and frees the frame). If we
+	// found a free frame instead, somebody freed it while we were yielding
+	if(should_i_swap_out)
+	{
+		evict_page(victim_index);
+		vmstats.vs_random_evictions++;
+	}
+}
+
+/*
+ * Pageout daemon. Sleeps until free pages drop below the low watermark, then
+ * evicts pages picked by the clock until there are high watermark free pages
+ * again, so faults can usually take a free page straight away. Releasing the
+ * core map lock doesn't hand it to a waiter, so the daemon yields after each
+ * eviction to let faulting threads have it. If there is nothing to evict it
+ * waits a second before looking again.
+ */
+static void
+pageout_daemon(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while(1)
+	{
+		int spl = splhigh();
+		while(num_free_pages >= pageout_low)
+		{
+			thread_sleep(&pageout_thread);
+		}
+		splx(spl);
+
+		vmstats.vs_pageout_runs++;
+		while(1)
+		{
+			lock_acquire(core_map_lock);
+			if(num_free_pages >= pageout_high)
+			{
+				lock_release(core_map_lock);
+				break;
+			}
+			int victim = clock_find_victim();
+			if(victim == -1)
+			{
+				// Nothing we can evict. Wait for things to change
+				lock_release(core_map_lock);
+				spl = splhigh();
+				thread_sleep(&lbolt);
+				splx(spl);
+				break;
+			}
+			if(pages[victim].flags & PFLAG_USED_MASK)
+			{
+				evict_page_clustered(victim);
+				vmstats.vs_pageout_evictions++;
+			}
+			lock_release(core_map_lock);
+
+			// Let the threads waiting for the core map in first
+			thread_yield();
+		}
+	}
+}
+
+void
+pageout_bootstrap(void)
+{
+	pageout_low = num_pages / 16;
+	if(pageout_low < 2)
+	{
+		pageout_low = 2;
+	}
+	pageout_high = pageout_low * 2;
+
+	if(thread_fork("pageout", NULL, 0, pageout_daemon, &pageout_thread))
+	{
+		panic("Couldn't start the pageout daemon\n");
+	}
+}
+
+/*
+ * Take a free frame off the free lists. If there are none, make one
+ * available by swapping. 'as' and 'vpn' are the fault we are doing it for.
+ * The core map must be locked.
+ */
+static int alloc_frame(struct addrspace *as, vaddr_t vpn)
+{
+	int i;
+	assert(lock_do_i_hold(core_map_lock));
+	while((i = coremap_alloc_run(1)) == -1)
+	{
+		make_pg_available(as, vpn);
+	}
+	return i;
+}
+
+/*
+ * Page alloc and free for user processes. The frame has no address space
+ * in the core map until the caller maps it (and sets pages[].as), so the
+ * clock can't pick it while we sleep before that.
+ */
+paddr_t
+alloc_page(struct addrspace *cur_proc, vaddr_t vpn)
+{
+	assert(pages != NULL);
+	assert(cur_proc != NULL); // an address space is mandatory for user page allocation
+
+	lock_acquire(core_map_lock);
+	int i = alloc_frame(cur_proc, vpn);
+
+	// Upadate the coremap
+	pages[i].as = NULL;
+	pages[i].vpn = vpn;
+	pages[i].flags = PFLAG_USED_MASK | PFLAG_REFERENCED;
+	pages[i].refcount = 1;
+	pages[i].swap_slot = PAGE_NO_SWAP_SLOT;
+	lock_release(core_map_lock);
+
+	return free_paddr + i * PAGE_SIZE;
+}
+
+void
+free_page(paddr_t page)
+{
+	// Make sure its page aligned
+	assert((page % PAGE_SIZE) == 0);
+	int page_index = (page - free_paddr) / PAGE_SIZE;
+
+	lock_acquire(core_map_lock);
+	assert(page_index >= 0 && page_index < num_pages);
+	assert(pages != NULL);
+
+	// Now free this page
+	coremap_free_run(page_index, 1);
+
+	lock_release(core_map_lock);
+}
+
+/*
+ * Page tables live in frames taken from the core map when first needed and
+ * are found through the page directory. Their core map entries are marked
+ * PFLAG_PAGE_TABLE and name the owning address space and the first address
+ * they map. The clock leaves them alone; see reclaim_page_table.
+ */
+
+/*
+ * Return the page table entry for 'vpn' in 'as'. The page table is created,
+ * or brought back from swap, if need be. The core map must be locked.
+ * Getting a frame for the page table can evict pages, so other page table
+ * entry pointers the caller holds may be stale afterwards.
+ */
+static struct page_table* get_pte(struct addrspace *as, vaddr_t vpn)
+{
+	int pgdir_index = vpn >> 22;
+	int32_t entry;
+	paddr_t ptbl_addr;
+	int i;
+
+	assert(lock_do_i_hold(core_map_lock));
+	while(!(as->pg_dir[pgdir_index].pg_dir_entry & PGDIR_PRESENT))
+	{
+		i = alloc_frame(as, vpn);
+		entry = as->pg_dir[pgdir_index].pg_dir_entry;
+		if(entry & PGDIR_PRESENT)
+		{
+			// Somebody brought it in while we waited for the frame
+			coremap_free_run(i, 1);
+			break;
+		}
+
+		ptbl_addr = free_paddr + i * PAGE_SIZE;
+		pages[i].as = as;
+		pages[i].vpn = vpn & PGDIR_INDEX;
+		pages[i].flags = PFLAG_USED_MASK | PFLAG_PAGE_TABLE;
+		pages[i].refcount = 1;
+		pages[i].swap_slot = PAGE_NO_SWAP_SLOT;
+
+		if(entry & PGDIR_LOADED)
+		{
+			// Swapped out. Only its entries for pages in swap matter
+			//kprintf("PGDIR:Swapping in page table in directory 0x%x\n", vpn & PGDIR_INDEX);
+			swap_in_page(PGTBL_SWAP_SLOT(entry), ptbl_addr);
+			swap_free_slot(PGTBL_SWAP_SLOT(entry));
+			VMSTAT_ADD(as, vs_ptbl_swap_ins, 1);
+		}
+		else
+		{
+			bzero((void*)PADDR_TO_KVADDR(ptbl_addr), PAGE_SIZE);
+		}
+		as->pg_dir[pgdir_index].pg_dir_entry = ptbl_addr | PGDIR_LOADED | PGDIR_PRESENT;
+	}
+	return lookup_pte(as, vpn);
+}
+
+/*
+ * Give up the frame of a page table none of whose pages are in memory.
+ * Called only when there are no user pages left to evict. A page table that
+ * still tracks pages in swap is swapped out, one that doesn't is just
+ * dropped (its pages are loaded or zero filled afresh on the next fault).
+ * Returns 0 if there is no such page table.
+ */
+static int reclaim_page_table(void)
+{
+	struct page_table *ptbl;
+	struct addrspace *as;
+	int i, j, pgdir_index, swapped;
+	paddr_t ptbl_addr;
+
+	assert(lock_do_i_hold(core_map_lock));
+	for(i = 0; i < num_pages; ++i)
+	{
+		if(!(pages[i].flags & PFLAG_USED_MASK) || !(pages[i].flags & PFLAG_PAGE_TABLE))
+		{
+			continue;
+		}
+		ptbl_addr = free_paddr + i * PAGE_SIZE;
+		ptbl = (struct page_table*)PADDR_TO_KVADDR(ptbl_addr);
+		swapped = 0;
+		for(j = 0; j < 1024; ++j)
+		{
+			if(ptbl[j].pg_tbl_entry & PGTBL_VALID_MASK)
+			{
+				break;
+			}
+			if(ptbl[j].pg_tbl_entry & PF_L)
+			{
+				swapped = 1;
+			}
+		}
+		if(j < 1024)
+		{
+			continue;
+		}
+
+		as = pages[i].as;
+		pgdir_index = pages[i].vpn >> 22;
+		assert((as->pg_dir[pgdir_index].pg_dir_entry & PAGE_FRAME) == ptbl_addr);
+		if(swapped)
+		{
+			//kprintf("PGDIR:Swapping out page table in directory 0x%x\n", pages[i].vpn);
+			u_int32_t slot = swap_out_page(ptbl_addr);
+			as->pg_dir[pgdir_index].pg_dir_entry = PGTBL_MK_SWAP_SLOT(slot) | PGDIR_LOADED;
+			VMSTAT_ADD(as, vs_ptbl_swap_outs, 1);
+		}
+		else
+		{
+			as->pg_dir[pgdir_index].pg_dir_entry = 0;
+		}
+		coremap_free_run(i, 1);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Swap in the page of 'as' at 'vpn' from section 'slot' to 'page_addr'. The
+ * pages after it that were written out in the same cluster (the next
+ * sections hold the next pages of the same page table) come in with the
+ * same disk request, while there are free frames to spare. They are mapped
+ * but not referenced, so the clock takes them back first if they go unused.
+ *
+ * A page that came from the disk keeps its swap copy, and the page table
+ * entry's reference to it, so it doesn't need writing if it is evicted
+ * again while clean. One that came from the compressed pool lets its copy
+ * go: the pool is small and holding copies of pages that are in memory
+ * (and may soon be stale) would push later evictions out to the disk. The
+ * page is marked dirty so it is stored again if it is evicted.
+ */
+static void swap_in_readahead(struct addrspace *as, vaddr_t vpn, u_int32_t slot, paddr_t page_addr)
+{
+	paddr_t addrs[SWAP_CLUSTER_MAX];
+	int pooled[SWAP_CLUSTER_MAX];
+	struct page_table *pte;
+	vaddr_t v;
+	int n, i, index, reads;
+
+	assert(lock_do_i_hold(core_map_lock));
+	addrs[0] = page_addr;
+	pages[(page_addr - free_paddr) / PAGE_SIZE].swap_slot = slot;
+
+	for(n = 1; n <= swap_readahead_pages; ++n)
+	{
+		v = vpn + n * PAGE_SIZE;
+		// Stay in our page table, which is in memory
+		if((v >> 22) != (vpn >> 22) || num_free_pages <= pageout_low)
+		{
+			break;
+		}
+		pte = lookup_pte(as, v);
+		if((pte->pg_tbl_entry & PGTBL_VALID_MASK) || !(pte->pg_tbl_entry & PF_L) ||
+				PGTBL_SWAP_SLOT(pte->pg_tbl_entry) != slot + n)
+		{
+			break;
+		}
+		i = coremap_alloc_run(1);
+		if(i == -1)
+		{
+			break;
+		}
+		pages[i].as = as;
+		pages[i].vpn = v;
+		pages[i].flags = PFLAG_USED_MASK;
+		pages[i].refcount = 1;
+		pages[i].swap_slot = slot + n;
+		addrs[n] = free_paddr + i * PAGE_SIZE;
+	}
+
+	reads = swap_read_cluster(slot, addrs, n, pooled);
+	VMSTAT_ADD(as, vs_swap_ins, n);
+	VMSTAT_ADD(as, vs_swap_reads, reads);
+	VMSTAT_ADD(as, vs_readaheads, n - 1);
+
+	for(i = 0; i < n; ++i)
+	{
+		if(pooled[i])
+		{
+			index = (addrs[i] - free_paddr) / PAGE_SIZE;
+			swap_free_slot(slot + i);
+			pages[index].swap_slot = PAGE_NO_SWAP_SLOT;
+			pages[index].flags |= PFLAG_DIRTY;
+		}
+	}
+
+	// We held the core map lock all along, so nobody touched these
+	for(i = 1; i < n; ++i)
+	{
+		pte = lookup_pte(as, vpn + i * PAGE_SIZE);
+		pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_COW_MASK | PGTBL_MOD_MASK);
+		pte->pg_tbl_entry |= addrs[i] | PGTBL_VALID_MASK;
+	}
+}
+
+/*
+ * This function implements on demand loading. It will look at the
+ * faulting address and determine if loading of that segment is
+ * required and load it if necessary.
+ *
+ * We need the pointer to the page table entry because for data segments
+ * we will update the flags to say it is now loaded. In future data segments
+ * will be swapped to the swap file and will not be loaded from the executable
+ */
+void load_segment_if_required(struct addrspace *as, vaddr_t faultaddress, paddr_t page_paddr,
+		int32_t *pg_tbl_entry)
+{
+	// First find out which region is the executable region
+	// in our address space
+	vaddr_t exec_vbase, exec_vtop;
+	vaddr_t data_vbase, data_vtop;
+	struct vm_mapping *mm;
+
+	if(as->as_flags1 & PF_X)
 	{
-		victim_index = max_diff_index;
+		exec_vbase = as->as_vbase1;
+		exec_vtop = exec_vbase + as->as_npages1 * PAGE_SIZE;
+
+		data_vbase = as->as_vbase2;
+		data_vtop = data_vbase + as->as_npages2 * PAGE_SIZE;
 	}
 	else
 	{
-		victim_index = alternate_index;
+		// Otherwise 2 MUST be the executable region
+		assert(as->as_flags2 & PF_X);
+		exec_vbase = as->as_vbase2;
+		exec_vtop = exec_vbase + as->as_npages2 * PAGE_SIZE;
+
+		data_vbase = as->as_vbase1;
+		data_vtop = data_vbase + as->as_npages1 * PAGE_SIZE;
 	}
-#endif
 
-//#if 0
-	while(1)
+	if(faultaddress >= exec_vbase && faultaddress < exec_vtop)
 	{
-		int i_start = random() % num_pages;
-		int i;
-		victim_index = -1;
-		for(i = i_start; i < num_pages; ++i)
+		// This is the executable. Load the corresponding page
+		vaddr_t vpn = faultaddress & PAGE_FRAME;
+		size_t filesize, memsize;
+		size_t num_pages_ahead = (vpn - exec_vbase) / PAGE_SIZE;
+		assert((num_pages_ahead * PAGE_SIZE) <= as->executable_filesize);
+		assert((num_pages_ahead * PAGE_SIZE) <= as->executable_memsize);
+		filesize = as->executable_filesize - num_pages_ahead * PAGE_SIZE;
+		memsize = as->executable_memsize - num_pages_ahead * PAGE_SIZE;
+		off_t pos = as->executable_offset + num_pages_ahead * PAGE_SIZE;
+
+		if(filesize > PAGE_SIZE)
 		{
-			if(!(pages[i].flags & PFLAG_USED_MASK))
-			{
-				victim_index = i;
-				should_i_swap_out = 0;
-				break;
-			}
-			else if(pages[i].as == as)
-			{
-				victim_index = i;
-				break;
-			}
+			filesize = PAGE_SIZE;
 		}
-		if(victim_index == -1)
+		if(memsize > PAGE_SIZE)
 		{
-			for(i = i_start; i >= 0; --i)
-			{
-				if(!(pages[i].flags & PFLAG_USED_MASK))
-				{
-					victim_index = i;
-					should_i_swap_out = 0;
-					break;
-				}
-				else if(pages[i].as == as)
-				{
-					victim_index = i;
-					break;
-				}
-			}
+			memsize = PAGE_SIZE;
 		}
 
-		if(victim_index == -1)
+		load_page_from_executable(as->as_vnode, pos, vpn, page_paddr, memsize, filesize);
+		VMSTAT_ADD(as, vs_page_loads, 1);
+		DEBUG(DB_EXEC, "Loaded an executable page at vaddr:0x%x, paddr:0x%x on demand\n", vpn, page_paddr);
+	}
+	else if(faultaddress >= data_vbase && faultaddress < data_vtop && !((*pg_tbl_entry) & PF_L))
+	{
+		// This a data page. Load the corresponding page from executable
+		vaddr_t vpn = faultaddress & PAGE_FRAME;
+		size_t filesize, memsize;
+		size_t num_pages_ahead = (vpn - data_vbase) / PAGE_SIZE;
+		assert((num_pages_ahead * PAGE_SIZE) <= as->data_memsize);
+		if(num_pages_ahead * PAGE_SIZE  > as->data_filesize)
 		{
-			lock_release(core_map_lock);
-			thread_yield();
-			lock_acquire(core_map_lock);
+			filesize = 0;
 		}
 		else
 		{
-			break;
+			filesize = as->data_filesize - num_pages_ahead * PAGE_SIZE;
 		}
-	}
-//#endif
-
-	// We have our victim. Swap him out, remove the valid bit in his page table
-	// entry and return this physical address
-	vaddr_t victim_vpn = pages[victim_index].vpn;
-	int victim_is_executable = 0;
-	struct addrspace *victim_as = pages[victim_index].as;
-	paddr_t page_addr = free_paddr + victim_index * PAGE_SIZE;
+		memsize = as->data_memsize - num_pages_ahead * PAGE_SIZE;
+		off_t pos = as->data_offset + num_pages_ahead * PAGE_SIZE;
 
-	// Update victim's page table only if this page was in use
-	if(pages[victim_index].flags & PFLAG_USED_MASK)
-	{
-		assert(victim_as != NULL);
-		if(victim_as->as_flags1 & PF_X)
+		if(filesize > PAGE_SIZE)
 		{
-			executable_vbase = victim_as->as_vbase1;
-			executable_vtop = victim_as->as_vbase1 + victim_as->as_npages1 * PAGE_SIZE;
+			filesize = PAGE_SIZE;
 		}
-		else
+		if(memsize > PAGE_SIZE)
 		{
-			assert(victim_as->as_flags2 & PF_X);
-			executable_vbase = victim_as->as_vbase2;
-			executable_vtop = victim_as->as_vbase2 + victim_as->as_npages2 * PAGE_SIZE;
+			memsize = PAGE_SIZE;
 		}
-		if(victim_vpn >= executable_vbase && victim_vpn < executable_vtop)
+
+		load_page_from_executable(as->as_vnode, pos, vpn, page_paddr, memsize, filesize);
+		VMSTAT_ADD(as, vs_page_loads, 1);
+		(*pg_tbl_entry) |= PF_L; // data page now loaded
+		DEBUG(DB_EXEC, "Loaded a data page at vaddr:0x%x, paddr:0x%x on demand\n", vpn, page_paddr);
+	}
+	else if((mm = mapping_find(as, faultaddress)) != NULL && !((*pg_tbl_entry) & PF_L))
+	{
+		// A page of a mapped file. Shared ones always come from the file,
+		// a private one is ours once loaded and goes to swap if written
+		mapping_read_page(mm, faultaddress & PAGE_FRAME, page_paddr);
+		VMSTAT_ADD(as, vs_mmap_reads, 1);
+		if(mm->mm_flags == MAP_PRIVATE)
 		{
-			victim_is_executable = 1;
-			// No need to swap. Victim will be demand loaded
-			should_i_swap_out = 0;
+			(*pg_tbl_entry) |= PF_L;
 		}
-		struct page_table *pg_tbl = get_ptbl(victim_as, victim_vpn, victim_is_executable);
-		int victim_page_table_index = (victim_vpn & PGTBL_INDEX) >> 12;
-		pg_tbl[victim_page_table_index].pg_tbl_entry &= ~PGTBL_VALID_MASK;
-		assert(page_addr == (pg_tbl[victim_page_table_index].pg_tbl_entry & PAGE_FRAME));
 	}
-#if 0
-	if(!(page_addr == (pg_tbl[victim_page_table_index].pg_tbl_entry & PAGE_FRAME)))
+	else if(faultaddress >= as->as_heap_vstart && faultaddress < as->as_heap_vtop && !((*pg_tbl_entry) & PF_L))
 	{
-		kprintf("Address 0x%x\n", &pg_tbl[victim_page_table_index].pg_tbl_entry);
-		panic("Victim vpn: 0x%x, page_addr: 0x%x, page_table_entry: 0x%x\n",
-				victim_vpn, page_addr, pg_tbl[victim_page_table_index].pg_tbl_entry);
+		// This heap segment is vaid. Start it off zeroed, it might be
+		// dropped and zero filled again if it is evicted before a write
+		bzero((void*)PADDR_TO_KVADDR(page_paddr), PAGE_SIZE);
+		(*pg_tbl_entry) |= PF_L;
 	}
-#endif
-
-	// Invalidate victim's TLB entry
-	u_int32_t ehi, elo;
-	int i;
-	for(i = 0; i < NUM_TLB; ++i)
+	else if(faultaddress >= as->as_stack_vbase && faultaddress < USERSTACK && !((*pg_tbl_entry) & PF_L))
 	{
-		TLB_Read(&ehi, &elo, i);
-		if ((ehi & TLBHI_VPAGE) == victim_vpn)
-		{
-			TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-		}
+		// This stack segment is now loaded.
+		bzero((void*)PADDR_TO_KVADDR(page_paddr), PAGE_SIZE);
+		(*pg_tbl_entry) |= PF_L;
 	}
-
-	if(should_i_swap_out)
+	else
 	{
-//		kprintf("Swapping out 0x%x for addrspace 0x%x\n", victim_vpn, victim_as);
-		swap_out_page(victim_as, victim_vpn, page_addr);
+		// So this is not an executable. It is either a data, heap or stack which was loaded before
+		// and has been swapped to disk. Swap it back in
+//		kprintf("Swapping in 0x%x for addrspace 0x%x\n", faultaddress, as);
+		assert(lock_do_i_hold(core_map_lock));
+		assert(*pg_tbl_entry & PF_L);
+		swap_in_readahead(as, faultaddress & PAGE_FRAME, PGTBL_SWAP_SLOT(*pg_tbl_entry), page_paddr);
 	}
 
-	// Set core map entry to free
-	pages[victim_index].flags = 0;
-	*free_index = victim_index;
+	return;
 
-	return page_addr;
 }
 
 /*
- * Page alloc and free for user processes
+ * Would a fault on 'vpn' load it from the executable? True for text and
+ * for data pages that haven't been loaded yet ('entry' is the page's
+ * page table entry). Anything else is zero filled or swapped in.
  */
-paddr_t
-alloc_page(struct addrspace *cur_proc, vaddr_t vpn)
+static int vpn_is_file_backed(struct addrspace *as, vaddr_t vpn, int32_t entry)
 {
-	assert(pages != NULL);
-	paddr_t page_paddr = 0;
+	if(elf_region_flags(as, vpn) == -1)
+	{
+		return 0;
+	}
+	return vpn_is_executable(as, vpn) || !(entry & PF_L);
+}
 
-	lock_acquire(core_map_lock);
+/*
+ * Called with the core map locked after 'vpn' was loaded from the
+ * executable. If the loads of 'as' have been going through the file in
+ * order, the pages after this one are loaded now too while there are
+ * frames to spare. They are not marked referenced, so the clock takes
+ * them back first if they go unused.
+ */
+static void exec_readahead(struct addrspace *as, vaddr_t vpn)
+{
+	struct page_table *pte;
+	paddr_t page_addr;
+	vaddr_t v;
+	int32_t flags;
+	int n, i;
 
-	/*
-	 * Scan the coremap to find a free page,
-	 * if no free pages are found we panic (for now).
-	 * This will change when we implement swapping
-	 */
-	int i = 0;
-	for(i = 0; i < num_pages; i++)
+	assert(lock_do_i_hold(core_map_lock));
+
+	int sequential = (vpn == as->as_seq_next);
+	as->as_seq_next = vpn + PAGE_SIZE;
+	if(!sequential)
 	{
-		if(!(pages[i].flags & PFLAG_USED_MASK))
+		return;
+	}
+
+	for(n = 1; n <= exec_readahead_pages; ++n)
+	{
+		v = vpn + n * PAGE_SIZE;
+		// Stay in our page table, which is in memory
+		if((v >> 22) != (vpn >> 22) || num_free_pages <= pageout_low)
 		{
-			// Found a free page
-			page_paddr = free_paddr + i * PAGE_SIZE;
 			break;
 		}
+		pte = lookup_pte(as, v);
+		flags = elf_region_flags(as, v);
+		if(!(pte->pg_tbl_entry & PGTBL_VALID_MASK) && !page_cache_map(as, v, pte, flags))
+		{
+			if(!vpn_is_file_backed(as, v, pte->pg_tbl_entry))
+			{
+				break;
+			}
+			i = coremap_alloc_run(1);
+			if(i == -1)
+			{
+				break;
+			}
+			pages[i].as = as;
+			pages[i].vpn = v;
+			pages[i].flags = PFLAG_USED_MASK;
+			pages[i].refcount = 1;
+			pages[i].swap_slot = PAGE_NO_SWAP_SLOT;
+			page_addr = free_paddr + i * PAGE_SIZE;
+
+			// We hold the core map lock while loading, so the page
+			// table stays put
+			load_segment_if_required(as, v, page_addr, &pte->pg_tbl_entry);
+			pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_COW_MASK | PGTBL_MOD_MASK);
+			pte->pg_tbl_entry |= page_addr | flags | PGTBL_VALID_MASK;
+			if(page_is_cacheable(as, v))
+			{
+				page_cache_insert(i);
+			}
+			VMSTAT_ADD(as, vs_exec_readaheads, 1);
+		}
+		as->as_seq_next = v + PAGE_SIZE;
 	}
+}
 
-	// If there were no free pages, make one available by swapping
-	if(page_paddr == 0)
-		page_paddr = make_pg_available(cur_proc, vpn, &i);
+/*
+ * Fault-around. Enter the resident pages following 'vpn' in the TLB along
+ * with it, so going through pages that are already in memory doesn't take
+ * a fault per page. Only pages that are referenced already are entered:
+ * a TLB entry keeps the clock from seeing later uses, and pages that were
+ * only read ahead (by exec_readahead or swap_in_readahead) must stay
+ * unreferenced until they are used, so the clock takes them back first if
+ * they aren't. Pages that haven't been written are mapped read only, as
+ * in vm_fault.
+ */
+static void fault_around(struct addrspace *as, vaddr_t vpn)
+{
+	struct page_table *pte;
+	u_int32_t ehi, elo;
+	vaddr_t v;
+	int n;
 
-	// Swapping should always work
-	assert(page_paddr != 0);
+	if(fault_around_pages == 0)
+	{
+		return;
+	}
 
-	// Upadate the coremap
-	assert(cur_proc != NULL); // an address space is mandatory for user page allocation
-	pages[i].as = cur_proc;
-	pages[i].vpn = vpn;
-	pages[i].flags = PFLAG_USED_MASK;
+	lock_acquire(core_map_lock);
+	for(n = 1; n <= fault_around_pages; ++n)
+	{
+		v = vpn + n * PAGE_SIZE;
+		if((v >> 22) != (vpn >> 22))
+		{
+			break;
+		}
+		pte = lookup_pte(as, v);
+		if(pte == NULL)
+		{
+			break;
+		}
+		if(!(pte->pg_tbl_entry & PGTBL_VALID_MASK) ||
+				!(pages[((pte->pg_tbl_entry & PAGE_FRAME) - free_paddr) / PAGE_SIZE].flags &
+					PFLAG_REFERENCED))
+		{
+			continue;
+		}
+		ehi = v | (as->as_asid << TLBHI_PIDSHIFT);
+		if(TLB_Probe(ehi, 0) >= 0)
+		{
+			continue;
+		}
+		elo = (pte->pg_tbl_entry & PAGE_FRAME) | TLBLO_VALID;
+		if((pte->pg_tbl_entry & PF_W) && (pte->pg_tbl_entry & PGTBL_MOD_MASK) &&
+				!(pte->pg_tbl_entry & PGTBL_COW_MASK))
+		{
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_load(ehi, elo);
+		VMSTAT_ADD(as, vs_fault_arounds, 1);
+	}
 	lock_release(core_map_lock);
-
-	return page_paddr;
 }
 
-void
-free_page(paddr_t page)
+/*
+ * Called at splhigh after a fault at 'vpn' grew the stack of 'as'. A
+ * stack that grows keeps growing (a deep recursion, say), so the pages
+ * below are grown into now too, while there are frames to spare. They
+ * are zeroed, marked written (stack pages are written before they are
+ * read) and entered in the TLB, so going down through them takes no
+ * faults at all.
+ */
+static void stack_prefault(struct addrspace *as, vaddr_t vpn)
 {
-	// Make sure its page aligned
-	assert((page % PAGE_SIZE) == 0);
-	int page_index = (page - free_paddr) / PAGE_SIZE;
+	struct page_table *pte;
+	vaddr_t v, limit;
+	paddr_t page_addr;
+	int n, i;
 
+	limit = USERSTACK - as->as_stack_max * PAGE_SIZE;
 	lock_acquire(core_map_lock);
-	assert(page_index >= 0 && page_index < num_pages);
-	assert(pages != NULL);
-
-	// Now free this page
-	pages[page_index].as = NULL;
-	pages[page_index].flags = 0;
-
+	for(n = 1; n <= stack_prefault_pages; ++n)
+	{
+		v = vpn - n * PAGE_SIZE;
+		// Stay in our page table, which is in memory
+		if(v < limit || v < as->as_heap_vtop || (v >> 22) != (vpn >> 22) ||
+				num_free_pages <= pageout_low)
+		{
+			break;
+		}
+		pte = lookup_pte(as, v);
+		if(pte == NULL || (pte->pg_tbl_entry & (PGTBL_VALID_MASK | PF_L)))
+		{
+			break;
+		}
+		i = coremap_alloc_run(1);
+		if(i == -1)
+		{
+			break;
+		}
+		page_addr = free_paddr + i * PAGE_SIZE;
+		bzero((void*)PADDR_TO_KVADDR(page_addr), PAGE_SIZE);
+		pages[i].as = as;
+		pages[i].vpn = v;
+		pages[i].flags = PFLAG_USED_MASK | PFLAG_DIRTY | PFLAG_REFERENCED;
+		pages[i].refcount = 1;
+		pages[i].swap_slot = PAGE_NO_SWAP_SLOT;
+		pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_COW_MASK);
+		pte->pg_tbl_entry |= page_addr | PF_R | PF_W | PF_L | PGTBL_MOD_MASK | PGTBL_VALID_MASK;
+		as->as_stack_vbase = v;
+		tlb_load(v | (as->as_asid << TLBHI_PIDSHIFT), page_addr | TLBLO_DIRTY | TLBLO_VALID);
+		VMSTAT_ADD(as, vs_stack_prefaults, 1);
+	}
 	lock_release(core_map_lock);
 }
 
 /*
- * Below are the set of functions that allow of swapping of page tables in and out
- * of memory.
- */
-
-/*
- * This function goes through the page tables already in memory and finds
- * a victim page table to evict. We always maintain atleast one executable
- * page table in memory.
+ * Function to find the correct pte given vpn using a two level paging
+ * Returns the pointer to the page table entry
+ * (Note not the pointer to the page in the pte)
+ * If the page isn't in memory, a frame is allocated and the page loaded.
+ * Called at splhigh, so the common case of a page already in memory is
+ * just the two table lookups without taking the core map lock.
  */
-int get_victim_slot(struct addrspace *as, int is_executable, vaddr_t vpgdir)
+struct page_table*
+find_pte(struct addrspace *cur_as, vaddr_t vpn, int32_t flags)
 {
-	int least_count = 0x7fffffff; // initialize to large number
-	int least_count_index = 0;
-	int i;
+	assert(cur_as != NULL);
 
-	if(is_executable)
+	struct page_table *pte = lookup_pte(cur_as, vpn);
+	if(pte != NULL && (pte->pg_tbl_entry & PGTBL_VALID_MASK))
 	{
-		// This is the case where the page table we want to put in
-		// memory is for executable page tables
-		for(i = 0; i < NUM_PTABLES_IN_MEM; ++i)
+		return pte;
+	}
+
+	if(page_is_cacheable(cur_as, vpn))
+	{
+		// Another process may have it in the page cache already
+		lock_acquire(core_map_lock);
+		pte = get_pte(cur_as, vpn);
+		if((pte->pg_tbl_entry & PGTBL_VALID_MASK) || page_cache_map(cur_as, vpn, pte, flags))
 		{
-			if((as->page_table_flags[i] & PINMEM_FLAG_EXECUTABLE_MASK) &&
-					((as->page_table_flags[i] & PINMEM_FLAG_COUNTER_MASK) < least_count))
-			{
-				least_count = as->page_table_flags[i] & PINMEM_FLAG_COUNTER_MASK;
-				least_count_index = i;
-			}
+			lock_release(core_map_lock);
+			return pte;
 		}
-		// If there were no executable page tables loaded. The '0'th one will be evicted
+		lock_release(core_map_lock);
 	}
-	else
-	{
-		// This is for data segments. We will evict executable page tables
-		// only if there are more than one currently loaded (don't think this
-		// is ever the case)
 
-		// We will also try to keep one page table for the stack and one
-		// for the data together if possible
-		int executable_count = 0;
-		int second_exec_ptable_index = -1;
-		least_count_index = -1;
-		for(i = 0; i < NUM_PTABLES_IN_MEM; ++i)
-		{
-			if(!(as->page_table_flags[i] & PINMEM_FLAG_EXECUTABLE_MASK) &&
-								((as->page_table_flags[i] & PINMEM_FLAG_COUNTER_MASK) < least_count))
-			{
-				least_count = as->page_table_flags[i] & PINMEM_FLAG_COUNTER_MASK;
-				least_count_index = i;
-			}
+	/*
+	 * Allocate a new page, read the page from disk and store the paddr
+	 * in the corresponding pg_tbl_entry. We update the coremap
+	 * in alloc_page, so dont have to do it here.
+	 */
+	paddr_t page_paddr = alloc_page(cur_as, vpn);
+	int page_index = (page_paddr - free_paddr) / PAGE_SIZE;
 
-			if(as->page_table_flags[i] & PINMEM_FLAG_EXECUTABLE_MASK)
-			{
-				++executable_count;
-				if(executable_count > 1)
-				{
-					// There are more than 1 executable page tables loaded
-					// This page table is a candidate for eviction
-					second_exec_ptable_index = i;
-				}
-			}
-			else if((as->page_table_flags[i] & PGDIR_INDEX) == vpgdir)
-			{
-				// This is asking for a page table in the same directory
-				// This probably means they are both stack or data
-				least_count_index = i;
-				break;
-			}
-		}
+	// Lock to prevent synchronization issues of our page table with the
+	// code in make_pg_available
+	lock_acquire(core_map_lock);
+	pte = get_pte(cur_as, vpn);
+	if((pte->pg_tbl_entry & PGTBL_VALID_MASK) || page_cache_map(cur_as, vpn, pte, flags))
+	{
+		// Loaded while we waited (read ahead, or by another process
+		// running our executable)
+		coremap_free_run(page_index, 1);
+		lock_release(core_map_lock);
+		return pte;
+	}
 
-		if(least_count_index == -1)
-		{
-			// Two many executable page tables were loaded.
-			// Evict one of them
-			assert(second_exec_ptable_index != -1);
-			least_count_index = second_exec_ptable_index;
-		}
+	int file_backed = vpn_is_file_backed(cur_as, vpn, pte->pg_tbl_entry);
+	// If required, demand load the page
+	load_segment_if_required(cur_as, vpn, page_paddr, &(pte->pg_tbl_entry));
+
+	// First clear the physical address (or swap section) currently stored.
+	// The frame is private to us.
+	pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_COW_MASK | PGTBL_MOD_MASK);
+	pte->pg_tbl_entry |= (page_paddr & PAGE_FRAME) | flags | PGTBL_VALID_MASK;
+	pages[page_index].as = cur_as;
+	if(page_is_cacheable(cur_as, vpn))
+	{
+		page_cache_insert(page_index);
+	}
+	if(file_backed)
+	{
+		exec_readahead(cur_as, vpn);
 	}
-	return least_count_index;
+	lock_release(core_map_lock);
+	return pte;
 }
 
 /*
- * This searches the page tables already in memory. If a slot is free then the new page table
- * can be loaded there. Otherwise a slot is freed by swapping a page table out.
+ * Is 'vpn' anonymous memory of 'as', which starts off as zeros? The heap,
+ * the stack and data pages lying wholly in the BSS.
  */
-int find_slot_for_pg_table(struct addrspace *as, int is_executable, vaddr_t vpgdir)
+static int vpn_is_anonymous(struct addrspace *as, vaddr_t vpn)
 {
-	int i;
-	// First search if a slot in our page tables in mem array is free
-	for(i = 0; i < NUM_PTABLES_IN_MEM; ++i)
+	if((vpn >= as->as_heap_vstart && vpn < as->as_heap_vtop) ||
+			(vpn >= as->as_stack_vbase && vpn < USERSTACK))
 	{
-		if(as->page_table_flags[i] == 0)
-		{
-			return i;
-		}
+		return 1;
 	}
-
-	// Slot is not free. Find a victim to evict
-	int victim_index = get_victim_slot(as, is_executable, vpgdir);
-
-	// We have the page table with the least count. Swap him out and return
-	// this index
-	// The virtual address being passed below is the page directory index converted into kernel virtual address.
-	// It has no meaning and its purpose is to serve as a unique key for this swapped page table.
-	vaddr_t vpn = as->page_table_flags[victim_index] & PGDIR_INDEX;
-
-	// The swap function needs the actual physical address of the page
-	paddr_t page_addr = ((paddr_t)(as->ptables_in_mem[victim_index])) & 0x7fffffff;
-	//kprintf("PGDIR:Swapping out page table in directory 0x%x\n", vpn);
-
-	swap_out_page(as, PADDR_TO_KVADDR(vpn), page_addr);
-	as->page_table_flags[victim_index] = 0;
-
-	// Calculate the page directory index
-	vpn = vpn >> 22;
-	// Set this page directory entry to not PGDIR_PRESENT;
-	as->pg_dir[vpn].pg_dir_entry &= ~PGDIR_PRESENT;
-
-	return victim_index;
+	if(elf_region_flags(as, vpn) == -1 || vpn_is_executable(as, vpn))
+	{
+		return 0;
+	}
+	vaddr_t data_vbase = (as->as_flags1 & PF_X) ? as->as_vbase2 : as->as_vbase1;
+	return vpn - data_vbase >= as->data_filesize;
 }
 
 /*
- * Given the virtual page number, we return the pointer to the
- * page table. The page table should have been loaded already.
- *
- * I pass the index too because its already calculated before
+ * Read fault on 'vpn'. If it is anonymous memory that has never been
+ * touched, map the zero page there copy-on-write rather than giving it a
+ * frame of its own. The first write gets it a private zeroed frame (see
+ * copy_on_write). Returns the page table entry, or NULL if the page has to
+ * be found or loaded as usual by find_pte.
  */
-struct page_table* get_page_table(struct addrspace *as, vaddr_t vpn, int pgdir_index, int is_executable)
+static struct page_table*
+map_zero_page(struct addrspace *as, vaddr_t vpn, int32_t flags)
 {
-	if(as->pg_dir[pgdir_index].pg_dir_entry & PGDIR_PRESENT)
+	struct page_table *pte;
+
+	if(!vpn_is_anonymous(as, vpn))
 	{
-		// The page table corresponding to this directory is present in memory
-		// Search in our loaded page tables and return the pointer
-		int i;
-		for(i = 0; i < NUM_PTABLES_IN_MEM; ++i)
-		{
-			if((as->page_table_flags[i] & PGDIR_INDEX) == (vpn & PGDIR_INDEX))
-			{
-				// Increment the counter. The counter can overflow and wrap around, but I don't
-				// think we will ever actually reach that so I don't care
-				as->page_table_flags[i] = (as->page_table_flags[i] & ~PINMEM_FLAG_COUNTER_MASK)
-						| ((as->page_table_flags[i] + 1) & PINMEM_FLAG_COUNTER_MASK);
-				return as->ptables_in_mem[i];
-			}
-		}
-		panic("PGDIR_PRESENT bit was set but page_table was not found!\n");
+		return NULL;
 	}
 
-	// Page table is not present in memory. Find memory slot for it and swap in from disk
-	int empty_slot = find_slot_for_pg_table(as, is_executable, vpn & PGDIR_INDEX);
-	// The swap function needs the actual physical address of the page
-	paddr_t page_addr = ((paddr_t)(as->ptables_in_mem[empty_slot])) & 0x7fffffff;
-	//kprintf("PGDIR:Swapping in page table in directory 0x%x\n", vpn & PGDIR_INDEX);
-	swap_in_page(as, PADDR_TO_KVADDR(vpn & PGDIR_INDEX), page_addr);
-	as->pg_dir[pgdir_index].pg_dir_entry |= PGDIR_PRESENT;
-	as->page_table_flags[empty_slot] = (PGDIR_INDEX & vpn) |
-			(is_executable ? PINMEM_FLAG_EXECUTABLE_MASK : 0);
-	return as->ptables_in_mem[empty_slot];
-}
+	lock_acquire(core_map_lock);
+	pte = get_pte(as, vpn);
+	if(pte->pg_tbl_entry & (PGTBL_VALID_MASK | PF_L))
+	{
+		// In memory or in swap
+		lock_release(core_map_lock);
+		return NULL;
+	}
+	pte->pg_tbl_entry &= ~(PAGE_FRAME | PGTBL_MOD_MASK);
+	pte->pg_tbl_entry |= zero_page | flags | PF_L | PGTBL_COW_MASK | PGTBL_VALID_MASK;
+	pages[(zero_page - free_paddr) / PAGE_SIZE].refcount++;
+	VMSTAT_ADD(as, vs_zero_maps, 1);
+	lock_release(core_map_lock);
 
+	return pte;
+}
 
 /*
- * This function may have a similar name to the one above but it is a higher level
- * abstraction over it. This function when given a virtual page directory number
- * (sorry for calling it vpn) will
- * first check if the page table was previously loaded. In that case it will call
- * the similar named 'get_page_table' function to get that page table and return
- * it.
- * If the page table hasn't been loaded already, it will call 'find_slot_for_pg_table'
- * and return that.
+ * Give 'as' a private copy of the copy-on-write page at 'vpn'. Returns the page
+ * table entry, or NULL if the page changed under us while we were waiting
+ * for a free frame. The faulting instruction should then just be retried.
  */
-struct page_table* get_ptbl(struct addrspace *as, vaddr_t vpn, int is_executable)
+static struct page_table*
+copy_on_write(struct addrspace *as, vaddr_t vpn)
 {
-	int pgdir_index = vpn >> 22;
+	struct page_table *pte;
+	paddr_t old_paddr, new_paddr;
+	int old_index, new_index;
 
-	if(as == NULL)
+	lock_acquire(core_map_lock);
+	pte = lookup_pte(as, vpn);
+	if(pte == NULL || !(pte->pg_tbl_entry & PGTBL_VALID_MASK) || !(pte->pg_tbl_entry & PGTBL_COW_MASK))
+	{
+		lock_release(core_map_lock);
+		return NULL;
+	}
+	old_paddr = pte->pg_tbl_entry & PAGE_FRAME;
+	old_index = (old_paddr - free_paddr) / PAGE_SIZE;
+	if(pages[old_index].refcount == 1)
 	{
-		panic("Null addrspace pointer!\n");
+		// Everybody else has let go of this frame. It is all ours
+		assert(pages[old_index].as == as);
+		pte->pg_tbl_entry &= ~PGTBL_COW_MASK;
+		lock_release(core_map_lock);
+		return pte;
 	}
+	lock_release(core_map_lock);
+
+	new_paddr = alloc_page(as, vpn);
+	new_index = (new_paddr - free_paddr) / PAGE_SIZE;
 
-	if(as->pg_dir[pgdir_index].pg_dir_entry & PGDIR_LOADED)
+	lock_acquire(core_map_lock);
+	// The shared frame may have been evicted to make room for ours
+	pte = lookup_pte(as, vpn);
+	if(pte == NULL || !(pte->pg_tbl_entry & PGTBL_VALID_MASK) || !(pte->pg_tbl_entry & PGTBL_COW_MASK) ||
+			(pte->pg_tbl_entry & PAGE_FRAME) != old_paddr)
+	{
+		coremap_free_run(new_index, 1);
+		lock_release(core_map_lock);
+		return NULL;
+	}
+	if(old_paddr == zero_page)
 	{
-		return get_page_table(as, vpn, pgdir_index, is_executable);
+		// First write to anonymous memory
+		bzero((void*)PADDR_TO_KVADDR(new_paddr), PAGE_SIZE);
+		VMSTAT_ADD(as, vs_zero_fills, 1);
 	}
 	else
 	{
-		int empty_slot = find_slot_for_pg_table(as, is_executable, vpn & PGDIR_INDEX);
-		// This page table is now loaded
-		as->pg_dir[pgdir_index].pg_dir_entry |= PGDIR_LOADED | PGDIR_PRESENT;
-		as->page_table_flags[empty_slot] = (PGDIR_INDEX & vpn) |
-				(is_executable ? PINMEM_FLAG_EXECUTABLE_MASK : 0);
-		// zero the page table memory slot
-		bzero(as->ptables_in_mem[empty_slot], sizeof(as->ptables_in_mem[empty_slot]));
-		return as->ptables_in_mem[empty_slot];
+		memcpy((void*)PADDR_TO_KVADDR(new_paddr), (void*)PADDR_TO_KVADDR(old_paddr), PAGE_SIZE);
+		VMSTAT_ADD(as, vs_cow_breaks, 1);
 	}
+	pte->pg_tbl_entry = (pte->pg_tbl_entry & ~(PAGE_FRAME | PGTBL_COW_MASK)) | new_paddr;
+	pages[new_index].as = as;
+	release_frame(as, old_index);
+	lock_release(core_map_lock);
+
+	return pte;
 }
 
 /*
- * This function implements on demand loading. It will look at the
- * faulting address and determine if loading of that segment is
- * required and load it if necessary.
- *
- * We need the pointer to the page table entry because for data segments
- * we will update the flags to say it is now loaded. In future data segments
- * will be swapped to the swap file and will not be loaded from the executable
+ * Working set admission control. Each address space's working set is
+ * estimated as the pages it referenced since the last estimate plus the
+ * faults it took for pages that weren't in memory, so a process faulting
+ * hard counts for more than it holds. If the working sets of the running
+ * processes add up to more than the frames user pages can have, the
+ * youngest are suspended (they stop at their next fault from user mode,
+ * see vm_ws_wait) until there is room for them, rather than everybody
+ * thrashing. Their pages go unreferenced and the clock evicts them.
+ * Suspended processes keep the estimate they were suspended with and are
+ * let back in oldest first once that fits with pageout_high frames to
+ * spare, or when nobody else runs.
  */
-void load_segment_if_required(struct addrspace *as, vaddr_t faultaddress, paddr_t page_paddr,
-		int32_t *pg_tbl_entry)
+static void ws_update(void)
 {
-	// First find out which region is the executable region
-	// in our address space
-	vaddr_t exec_vbase, exec_vtop;
-	vaddr_t data_vbase, data_vtop;
+	struct addrspace *as, *oldest;
+	int i, capacity, demand, nactive;
 
-	if(as->as_flags1 & PF_X)
-	{
-		exec_vbase = as->as_vbase1;
-		exec_vtop = exec_vbase + as->as_npages1 * PAGE_SIZE;
+	assert(lock_do_i_hold(core_map_lock));
+	ws_window_faults = 0;
+	ws_updates++;
+	vmstats.vs_ws_checks++;
 
-		data_vbase = as->as_vbase2;
-		data_vtop = data_vbase + as->as_npages2 * PAGE_SIZE;
-	}
-	else
+	for(as = as_list; as != NULL; as = as->as_next)
 	{
-		// Otherwise 2 MUST be the executable region
-		assert(as->as_flags2 & PF_X);
-		exec_vbase = as->as_vbase2;
-		exec_vtop = exec_vbase + as->as_npages2 * PAGE_SIZE;
-
-		data_vbase = as->as_vbase1;
-		data_vtop = data_vbase + as->as_npages1 * PAGE_SIZE;
+		if(!as->as_suspended)
+		{
+			as->as_ws_pages = as->as_ws_faults;
+		}
+		as->as_ws_faults = 0;
 	}
 
-	if(faultaddress >= exec_vbase && faultaddress < exec_vtop)
+	// Referenced pages count for whoever holds them. The bits are cleared
+	// (and the TLB flushed so the next use sets them again) to start the
+	// next interval
+	capacity = num_free_pages;
+	for(i = 0; i < num_pages; ++i)
 	{
-		// This is the executable. Load the corresponding page
-		vaddr_t vpn = faultaddress & PAGE_FRAME;
-		size_t filesize, memsize;
-		size_t num_pages_ahead = (vpn - exec_vbase) / PAGE_SIZE;
-		assert((num_pages_ahead * PAGE_SIZE) <= as->executable_filesize);
-		assert((num_pages_ahead * PAGE_SIZE) <= as->executable_memsize);
-		filesize = as->executable_filesize - num_pages_ahead * PAGE_SIZE;
-		memsize = as->executable_memsize - num_pages_ahead * PAGE_SIZE;
-		off_t pos = as->executable_offset + num_pages_ahead * PAGE_SIZE;
-
-		if(filesize > PAGE_SIZE)
+		if(!(pages[i].flags & PFLAG_USED_MASK) || pages[i].as == NULL ||
+				(pages[i].flags & PFLAG_PAGE_TABLE))
 		{
-			filesize = PAGE_SIZE;
+			continue;
 		}
-		if(memsize > PAGE_SIZE)
+		capacity++;
+		if(pages[i].flags & PFLAG_REFERENCED)
 		{
-			memsize = PAGE_SIZE;
+			if(!pages[i].as->as_suspended)
+			{
+				pages[i].as->as_ws_pages++;
+			}
+			pages[i].flags &= ~PFLAG_REFERENCED;
 		}
-
-		load_page_from_executable(as->exec_path, pos, vpn, page_paddr, memsize, filesize);
-		DEBUG(DB_EXEC, "Loaded an executable page at vaddr:0x%x, paddr:0x%x on demand\n", vpn, page_paddr);
 	}
-	else if(faultaddress >= data_vbase && faultaddress < data_vtop && !((*pg_tbl_entry) & PF_L))
+	tlb_flush();
+
+	demand = 0;
+	nactive = 0;
+	for(as = as_list; as != NULL; as = as->as_next)
 	{
-		// This a data page. Load the corresponding page from executable
-		vaddr_t vpn = faultaddress & PAGE_FRAME;
-		size_t filesize, memsize;
-		size_t num_pages_ahead = (vpn - data_vbase) / PAGE_SIZE;
-		assert((num_pages_ahead * PAGE_SIZE) <= as->data_memsize);
-		if(num_pages_ahead * PAGE_SIZE  > as->data_filesize)
+		if(!as->as_suspended)
 		{
-			filesize = 0;
+			demand += as->as_ws_pages;
+			nactive++;
 		}
-		else
+	}
+
+	// The list is youngest first. Somebody always keeps running
+	for(as = as_list; as != NULL && ws_window > 0 && demand > capacity && nactive > 1; as = as->as_next)
+	{
+		if(!as->as_suspended)
 		{
-			filesize = as->data_filesize - num_pages_ahead * PAGE_SIZE;
+			as->as_suspended = 1;
+			demand -= as->as_ws_pages;
+			nactive--;
+			ws_nsuspended++;
+			vmstats.vs_ws_suspends++;
 		}
-		memsize = as->data_memsize - num_pages_ahead * PAGE_SIZE;
-		off_t pos = as->data_offset + num_pages_ahead * PAGE_SIZE;
+	}
 
-		if(filesize > PAGE_SIZE)
+	while(ws_nsuspended > 0)
+	{
+		oldest = NULL;
+		for(as = as_list; as != NULL; as = as->as_next)
 		{
-			filesize = PAGE_SIZE;
+			if(as->as_suspended)
+			{
+				oldest = as;
+			}
 		}
-		if(memsize > PAGE_SIZE)
+		assert(oldest != NULL);
+		if(ws_window > 0 && nactive > 0 &&
+				demand + (int)oldest->as_ws_pages + pageout_high > capacity)
 		{
-			memsize = PAGE_SIZE;
+			break;
 		}
-
-		load_page_from_executable(as->exec_path, pos, vpn, page_paddr, memsize, filesize);
-		(*pg_tbl_entry) |= PF_L; // data page now loaded
-		DEBUG(DB_EXEC, "Loaded a data page at vaddr:0x%x, paddr:0x%x on demand\n", vpn, page_paddr);
-	}
-	else if(faultaddress >= as->as_heap_vstart && faultaddress < as->as_heap_vtop && !((*pg_tbl_entry) & PF_L))
-	{
-		// This heap segment is vaid.
-		(*pg_tbl_entry) |= PF_L;
-	}
-	else if(faultaddress >= as->as_stack_vbase && faultaddress < USERSTACK && !((*pg_tbl_entry) & PF_L))
-	{
-		// This stack segment is now loaded.
-		(*pg_tbl_entry) |= PF_L;
-	}
-	else
-	{
-		// So this is not an executable. It is either a data, heap or stack which was loaded before
-		// and has been swapped to disk. Swap it back in
-//		kprintf("Swapping in 0x%x for addrspace 0x%x\n", faultaddress, as);
-		assert(lock_do_i_hold(core_map_lock));
-		swap_in_page(as, faultaddress, page_paddr);
+		oldest->as_suspended = 0;
+		demand += oldest->as_ws_pages;
+		nactive++;
+		ws_nsuspended--;
+		vmstats.vs_ws_resumes++;
 	}
-
-	return;
-
 }
 
 /*
- * Function to find the correct pte given vpn using a two level paging
- * Returns the pointer to the page table entry
- * (Note not the pointer to the page in the pte)
- * We allocate new pages only when alloc_new_pages = 1
+ * Count a fault of 'as' for a page that wasn't in memory. Makes a new
+ * working set estimate every ws_window of them while memory is short (or
+ * somebody is suspended). Otherwise the counts just start over.
  */
-struct page_table*
-find_pte(struct addrspace *cur_as, vaddr_t vpn, int32_t flags)
+static void ws_fault(struct addrspace *as)
 {
-	assert(cur_as != NULL);
-	vaddr_t executable_vbase, executable_vtop;
-	if(cur_as->as_flags1 & PF_X)
+	struct addrspace *other;
+
+	if(ws_window == 0)
 	{
-		executable_vbase = cur_as->as_vbase1;
-		executable_vtop = cur_as->as_vbase1 + (cur_as->as_npages1 * PAGE_SIZE);
+		return;
 	}
-	else
+	lock_acquire(core_map_lock);
+	as->as_ws_faults++;
+	if(++ws_window_faults >= ws_window)
 	{
-		executable_vbase = cur_as->as_vbase2;
-		executable_vtop = cur_as->as_vbase2 + (cur_as->as_npages2 * PAGE_SIZE);;
+		if(num_free_pages <= pageout_low || ws_nsuspended > 0)
+		{
+			ws_update();
+		}
+		else
+		{
+			ws_window_faults = 0;
+			for(other = as_list; other != NULL; other = other->as_next)
+			{
+				other->as_ws_faults = 0;
+			}
+		}
 	}
-	int is_executable = (vpn >= executable_vbase && vpn < executable_vtop);
-
-	lock_acquire(core_map_lock);
-	struct page_table *pg_tbl = get_ptbl(cur_as, vpn, is_executable);
 	lock_release(core_map_lock);
-	int pgtbl_index = (vpn & PGTBL_INDEX) >> 12;
+}
+
+/*
+ * Wait while 'as' is suspended. Checked once a second. If nobody has made
+ * a working set estimate in that time (the others aren't faulting much,
+ * or are blocked), we make one ourselves. Called at splhigh.
+ */
+static void ws_wait(struct addrspace *as)
+{
+	u_int32_t seen;
 
-	if(pg_tbl[pgtbl_index].pg_tbl_entry & PGTBL_VALID_MASK)
+	while(as->as_suspended)
 	{
-		return (&pg_tbl[pgtbl_index]);
+		seen = ws_updates;
+		thread_sleep(&lbolt);
+		lock_acquire(core_map_lock);
+		if(ws_updates == seen)
+		{
+			ws_update();
+		}
+		lock_release(core_map_lock);
 	}
-	else
-	{
-		/*
-		 * Allocate a new page, read the page from disk and store the paddr
-		 * in the corresponding pg_tbl_entry. We update the coremap
-		 * in alloc_page, so dont have to do it here.
-		 */
-		paddr_t page_paddr = alloc_page(cur_as, vpn);
+}
 
-		// Lock to prevent synchronization issues of our page table with the
-		// code in make_pg_available
-		lock_acquire(core_map_lock);
-		// If required, demand load the page
-		load_segment_if_required(cur_as, vpn, page_paddr, &(pg_tbl[pgtbl_index].pg_tbl_entry));
+/*
+ * Called by the trap code on faults from user mode, before vm_fault. A
+ * suspended process waits here. Faults the kernel takes (copyin and
+ * copyout in a system call) aren't stopped, since the system call may
+ * hold things other processes are waiting for.
+ */
+void
+vm_ws_wait(void)
+{
+	int spl;
 
-		// First clear the physical address currently stored
-		pg_tbl[pgtbl_index].pg_tbl_entry &= ~PAGE_FRAME;
-		pg_tbl[pgtbl_index].pg_tbl_entry |= (page_paddr & PAGE_FRAME) | flags | PGTBL_VALID_MASK;
-		lock_release(core_map_lock);
-		return (&pg_tbl[pgtbl_index]);
+	if(curthread->t_vmspace == NULL)
+	{
+		return;
 	}
+	spl = splhigh();
+	ws_wait(curthread->t_vmspace);
+	splx(spl);
 }
 
 int
@@ -1032,16 +2757,24 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	int32_t flags;
-	int i;
-	u_int32_t ehi, elo, elo_fault;
+	u_int32_t elo_fault;
 	struct addrspace *as;
 	struct page_table *pte;
+	struct vm_mapping *mm;
 	int spl;
 
 	spl = splhigh();
 
 	faultaddress &= PAGE_FRAME;
 
+	// Big kmallocs. Nothing to do with the current process
+	if(faultaddress >= MIPS_KSEG2)
+	{
+		int result = kva_fault(faultaddress);
+		splx(spl);
+		return result;
+	}
+
 	DEBUG(DB_VM, "vm_fault faultaddress: 0x%x, faulttype: %s, curthread: 0x%x, as: 0x%x\n",
 			faultaddress, vm_fault_type_str(faulttype), (vaddr_t)curthread, (vaddr_t)curthread->t_vmspace);
 
@@ -1055,6 +2788,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		splx(spl);
 		return EFAULT;
 	}
+	VMSTAT_ADD(as, vs_faults, 1);
 
 	/*
 	 * Setup the flags by checking where the faultaddress lies.
@@ -1067,9 +2801,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
 	stackbase = as->as_stack_vbase;
 	stacktop = USERSTACK;
-
-	// We will allow a max growth of 'DUMBVM_STACKPAGES' for the stack
-	vaddr_t max_stack_growth_base = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	int grew_stack = 0;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		flags = as->as_flags1;
@@ -1080,29 +2812,54 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		flags = PF_R | PF_W;
 	}
-	else if(faultaddress >= (stackbase - PAGE_SIZE) && faultaddress >= as->as_heap_vtop &&
-			faultaddress >= max_stack_growth_base)
+	else if(faultaddress < stackbase && faultaddress >= as->as_heap_vtop &&
+			faultaddress >= USERSTACK - as->as_stack_max * PAGE_SIZE)
 	{
 		// User wants to grow the stack and it does not collide with the heap.
-		// Currently allow stack to grow only 1 page at a time. Might have to
-		// change this if any of the test programs require a larger stack
-		// growth
+		// It can grow any distance at once (a big stack frame), down to its
+		// limit. The pages in between are anonymous, so they are zero filled
+		// when touched.
 		// Note: It is '>=' the heap top because the heap addresses are
 		// actually '<' heap_top
-		as->as_stack_vbase -= PAGE_SIZE;
+		as->as_stack_vbase = faultaddress;
 		flags = PF_R | PF_W;
+		grew_stack = 1;
 	}
 	else if(faultaddress >= as->as_heap_vstart && faultaddress < as->as_heap_vtop)
 	{
 		// User heap
 		flags = PF_R | PF_W;
 	}
+	else if((mm = mapping_find(as, faultaddress)) != NULL)
+	{
+		// Mapped file. The TLB can't make a page writable or
+		// executable but not readable, so only a PROT_NONE mapping
+		// can't be read. Turn it away before find_pte loads anything
+		flags = mm->mm_prot;
+		if(!(flags & (PF_R | PF_W | PF_X)))
+		{
+			splx(spl);
+			return VM_FAULT_USER;
+		}
+	}
 	else {
 		splx(spl);
 		// Segmentation Fault
 		return VM_FAULT_USER;
 	}
 
+	// A miss on a page that is in memory just needs a TLB refill. Most
+	// of those from user mode are done in exception.S and never get here
+	pte = lookup_pte(as, faultaddress);
+	if(faulttype != VM_FAULT_READONLY && pte != NULL && (pte->pg_tbl_entry & PGTBL_VALID_MASK))
+	{
+		VMSTAT_ADD(as, vs_tlb_refills, 1);
+	}
+	else if(faulttype != VM_FAULT_READONLY)
+	{
+		ws_fault(as);
+	}
+
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
 	    	/*
@@ -1113,27 +2870,73 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	    	pte = find_pte(as, faultaddress, flags);
 	    	if(pte->pg_tbl_entry & PF_W)
 	    	{
+	    		// Shared after a fork. Get our own copy now
+	    		if(pte->pg_tbl_entry & PGTBL_COW_MASK)
+	    		{
+	    			pte = copy_on_write(as, faultaddress);
+	    			if(pte == NULL)
+	    			{
+	    				splx(spl);
+	    				return VM_FAULT_OK;
+	    			}
+	    		}
+	    		// First write to this page
+	    		pte = page_dirtied_fault(as, faultaddress, pte);
+	    		if(pte == NULL)
+	    		{
+	    			splx(spl);
+	    			return VM_FAULT_OK;
+	    		}
 	    		elo_fault = (pte->pg_tbl_entry & PAGE_FRAME) | TLBLO_DIRTY | TLBLO_VALID;
 	    	}
 	    	else
 	    	{
 	    		// Writing to read only segment fault
+	    		splx(spl);
 	    		return VM_FAULT_USER;
 	    	}
 	    	break;
 
 	    case VM_FAULT_READ:
 	    	/* Call the find_pte function store paddr by reading the upper 20 bits pg_tbl_entry */
-	    	pte = find_pte(as, faultaddress, flags);
+	    	pte = map_zero_page(as, faultaddress, flags);
+	    	if(pte == NULL)
+	    	{
+	    		pte = find_pte(as, faultaddress, flags);
+	    	}
 	    	elo_fault = (pte->pg_tbl_entry & PAGE_FRAME) | TLBLO_VALID;
-	    	// If this page is writeable, we don't want to make it read only
-	    	if(pte->pg_tbl_entry & PF_W)
+	    	// Pages stay read only until they are written, so we get to see the
+	    	// first write (to mark the page dirty or copy it if it is shared
+	    	// copy-on-write)
+	    	if((pte->pg_tbl_entry & PF_W) && (pte->pg_tbl_entry & PGTBL_MOD_MASK) &&
+	    			!(pte->pg_tbl_entry & PGTBL_COW_MASK))
 	    	{
 	    		elo_fault |= TLBLO_DIRTY;
 	    	}
 	    	break;
 	    case VM_FAULT_WRITE:
 	    	pte = find_pte(as, faultaddress, flags);
+	    	if(!(pte->pg_tbl_entry & PF_W))
+	    	{
+	    		// Writing to read only segment fault
+	    		splx(spl);
+	    		return VM_FAULT_USER;
+	    	}
+	    	if(pte->pg_tbl_entry & PGTBL_COW_MASK)
+	    	{
+	    		pte = copy_on_write(as, faultaddress);
+	    		if(pte == NULL)
+	    		{
+	    			splx(spl);
+	    			return VM_FAULT_OK;
+	    		}
+	    	}
+	    	pte = page_dirtied_fault(as, faultaddress, pte);
+	    	if(pte == NULL)
+	    	{
+	    		splx(spl);
+	    		return VM_FAULT_OK;
+	    	}
 	    	elo_fault = (pte->pg_tbl_entry & PAGE_FRAME) | TLBLO_DIRTY | TLBLO_VALID;
 		break;
 	    default:
@@ -1143,38 +2946,21 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	}
 
 	/*
-	 * Populate the TLB entry using TLB_Random
+	 * Populate the TLB entry using TLB_Random. Our entries are tagged
+	 * with our ASID. We may have slept above but as_activate has run
+	 * for us since, so the ASID is current.
 	 */
-	/* Check if this entry is already present in the TLB */
-	i = TLB_Probe(faultaddress, 0);
-
-	if(i < 0)
-	{
-		/* Check if there are any free entries in the TLB */
-		for (i=0; i<NUM_TLB; i++)
-		{
-			TLB_Read(&ehi, &elo, i);
-			// If our faultaddress is already in the TLB, lets use that spot
-			if (elo & TLBLO_VALID) {
-				continue;
-			}
-			ehi = faultaddress;
-			DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, elo_fault & PAGE_FRAME);
-			TLB_Write(ehi, elo_fault, i);
-			splx(spl);
-			return VM_FAULT_OK;
-		}
+	assert(as_has_asid(as));
+	u_int32_t ehi_fault = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
+	page_referenced(elo_fault & TLBLO_PPAGE);
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, elo_fault & PAGE_FRAME);
+	tlb_load(ehi_fault, elo_fault);
 
-		/* If not then we are randomly going to choose one */
-		ehi = faultaddress;
-		TLB_Random(ehi, elo_fault);
-	}
-	else
+	if(grew_stack)
 	{
-		ehi = faultaddress;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, elo_fault & PAGE_FRAME);
-		TLB_Write(ehi, elo_fault, i);
+		stack_prefault(as, faultaddress);
 	}
+	fault_around(as, faultaddress);
 
 	splx(spl);
 	return VM_FAULT_OK;
@@ -1236,10 +3022,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	#endif
 }
 
+static
+int
+pg_dir_ctor(void *pg_dir)
+{
+	bzero(pg_dir, 1024 * sizeof(struct page_directory));
+	return 0;
+}
+
 struct addrspace *
 as_create(void)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	struct addrspace *as = slab_alloc(&as_cache);
 	if (as==NULL) {
 		return NULL;
 	}
@@ -1251,137 +3045,105 @@ as_create(void)
 	as->as_flags1 = 0;
 	as->as_flags2 = 0;
 	as->pg_dir = 0;
-	as->exec_path[0] = '\0';
+	as->as_vnode = NULL;
 	as->executable_offset = 0;
 	as->executable_memsize = 0;
 	as->executable_filesize = 0;
 	as->data_offset = 0;
 	as->data_filesize = 0;
 	as->data_memsize = 0;
+	as->as_next = NULL;
+	as->as_asid = 0;
+	as->as_asid_gen = 0;
+	as->as_seq_next = 0;
+	as->as_mmaps = NULL;
+	as->as_stack_max = stack_max_pages;
+	as->as_heap_max = heap_max_pages;
+	as->as_ws_pages = 0;
+	as->as_ws_faults = 0;
+	as->as_suspended = 0;
+	bzero(&as->as_stats, sizeof(struct vmstat));
 
 	/*
 	 * Need to create a new page for the page directory
 	 * Creating the pg_dir page in kernel memory - bcoz
-	 * there's only one per process
+	 * there's only one per process. It comes out of the cache zeroed
 	 */
 
-	as->pg_dir = kmalloc(1024 * sizeof(struct page_directory));
+	as->pg_dir = slab_alloc(&pg_dir_cache);
 	if(as->pg_dir == NULL)
 	{
-		kfree(as);
+		slab_free(&as_cache, as);
 		return NULL;
 	}
-	bzero(as->pg_dir, 1024 * sizeof(struct page_directory));
-	bzero(as->page_table_flags, sizeof(as->page_table_flags));
-	int i;
-	assert(sizeof(as->ptables_in_mem[0]) == PAGE_SIZE);
-	for(i = 0; i < NUM_PTABLES_IN_MEM; ++i)
+
+	lock_acquire(core_map_lock);
+	as->as_next = as_list;
+	as_list = as;
+	// Memory is overcommitted already. Wait behind the others
+	if(ws_window > 0 && ws_nsuspended > 0)
 	{
-		bzero(as->ptables_in_mem[i], 1024);
+		as->as_suspended = 1;
+		ws_nsuspended++;
+		vmstats.vs_ws_suspends++;
 	}
+	lock_release(core_map_lock);
 	return as;
 }
 
-// Copy an individual page table and allocate new pages
-void copy_individal_page_table(struct addrspace *as_old, struct addrspace *as_new,
-		struct page_table *ptbl_old, struct page_table *ptbl_new, vaddr_t vpgdir)
+// Copy an individual page table. The pages are not copied, they are shared
+// with the old address space and writable ones are marked copy-on-write in both.
+// The core map must be locked.
+void copy_individal_page_table(struct page_table *ptbl_old, struct page_table *ptbl_new)
 {
-	// Go through each entry in the page table, copy the info
-	// and do necessary page allocations
 	int i;
-	vaddr_t vpn;
-	paddr_t page_addr;
 	for(i = 0; i < 1024; ++i)
 	{
-		vpn = vpgdir | ((vaddr_t)i << 12);
-		// This page is loaded and is valid
-		if((ptbl_old[i].pg_tbl_entry & PF_L) && (ptbl_old[i].pg_tbl_entry & PGTBL_VALID_MASK))
-		{
-			page_addr = alloc_page(as_new, vpn);
-			// When we allocated a page for us, the old_process' page might have gotten swapped out
-			lock_acquire(core_map_lock);
-			if(ptbl_old[i].pg_tbl_entry & PGTBL_VALID_MASK)
-			{
-				// His page is still there. Copy directly
-				memcpy((void*)PADDR_TO_KVADDR(page_addr),
-						(void*)PADDR_TO_KVADDR(ptbl_old[i].pg_tbl_entry & PAGE_FRAME), PAGE_SIZE);
-			}
-			else
-			{
-				// His page was swapped out. Copy in the data from the swap file
-				// but don't remove his data from the swap file
-				swap_copy_in_page(as_old, vpn, page_addr);
-			}
-			ptbl_new[i].pg_tbl_entry = page_addr | (ptbl_old[i].pg_tbl_entry & ~PAGE_FRAME) | PGTBL_VALID_MASK;
-			lock_release(core_map_lock);
-		}
-		else if(ptbl_old[i].pg_tbl_entry & PF_L)
+		int32_t entry = ptbl_old[i].pg_tbl_entry;
+		if(entry & PGTBL_VALID_MASK)
 		{
-			// His page was swapped out. Copy in the data from the swap file
-			// but don't remove his data from the swap file
-			page_addr = alloc_page(as_new, vpn);
-			lock_acquire(core_map_lock);
-			if(ptbl_old[i].pg_tbl_entry & PGTBL_VALID_MASK)
-			{
-				// His page is still there. Copy directly
-				memcpy((void*)PADDR_TO_KVADDR(page_addr),
-						(void*)PADDR_TO_KVADDR(ptbl_old[i].pg_tbl_entry & PAGE_FRAME), PAGE_SIZE);
-			}
-			else
+			// One more sharer for this frame. Shared file pages stay
+			// writable by both
+			int index = ((entry & PAGE_FRAME) - free_paddr) / PAGE_SIZE;
+			pages[index].refcount++;
+			if((entry & PF_W) && !(pages[index].flags & PFLAG_FILE_SHARED))
 			{
-				// His page was swapped out. Copy in the data from the swap file
-				// but don't remove his data from the swap file
-				swap_copy_in_page(as_old, vpn, page_addr);
+				entry = (entry | PGTBL_COW_MASK) & ~PGTBL_MOD_MASK;
+				ptbl_old[i].pg_tbl_entry = entry;
 			}
-			ptbl_new[i].pg_tbl_entry = page_addr | (ptbl_old[i].pg_tbl_entry & ~PAGE_FRAME)  | PGTBL_VALID_MASK;
-			lock_release(core_map_lock);
 		}
+		else if(entry & PF_L)
+		{
+			// Swapped out. Whoever swaps it in first gets a private copy
+			swap_share_slot(PGTBL_SWAP_SLOT(entry));
+		}
+		ptbl_new[i].pg_tbl_entry = entry;
 	}
 }
 
 // Copy the page tables. This includes copying stuff in the page directories and all page tables
 void copy_all_page_tables(struct addrspace *as_old, struct addrspace *as_new)
 {
-	// First find out which region is the executable region
-	// in our address space
-	vaddr_t exec_vbase, exec_vtop;
-	if(as_new->as_flags1 & PF_X)
-	{
-		exec_vbase = as_new->as_vbase1;
-		exec_vtop = exec_vbase + as_new->as_npages1 * PAGE_SIZE;
-	}
-	else
-	{
-		// Otherwise 2 MUST be the executable region
-		assert(as_new->as_flags2 & PF_X);
-		exec_vbase = as_new->as_vbase2;
-		exec_vtop = exec_vbase + as_new->as_npages2 * PAGE_SIZE;
-	}
-
 	int i;
+	struct page_table *ptbl_old;
 	struct page_directory *pgdir_old = as_old->pg_dir;
 	struct page_directory *pgdir_new = as_new->pg_dir;
-	// Go through each directory, copy the directory entries and page tables
-	// if required
+	// Go through each directory and copy the page tables that exist
 	for(i = 0; i < 1024; ++i)
 	{
 		if(pgdir_old[i].pg_dir_entry & PGDIR_LOADED)
 		{
-			// This directory is loaded. Get the page
-			// table and copy it
 			lock_acquire(core_map_lock);
-			struct page_table *ptbl_old = get_page_table(as_old, (vaddr_t)i << 22, i, 0);
-			int empty_slot = find_slot_for_pg_table(as_new, 0, (vaddr_t)i << 22);
-			lock_release(core_map_lock);
-			copy_individal_page_table(as_old, as_new, ptbl_old,
-					as_new->ptables_in_mem[empty_slot], (vaddr_t)i << 22);
-
-			as_new->page_table_flags[empty_slot] = ((vaddr_t)i << 22);
-			if(((i << 22) & PGDIR_INDEX) == (exec_vbase & PGDIR_INDEX))
+			// Getting a frame for one page table may take the other's
+			// (they can both be empty of pages). Both have to be there
+			// at the same time
+			do
 			{
-				as_new->page_table_flags[empty_slot] |= PINMEM_FLAG_EXECUTABLE_MASK;
-			}
-			pgdir_new[i].pg_dir_entry = PGDIR_PRESENT | PGDIR_LOADED;
+				get_pte(as_new, (vaddr_t)i << 22);
+				ptbl_old = get_pte(as_old, (vaddr_t)i << 22);
+			} while(!(pgdir_new[i].pg_dir_entry & PGDIR_PRESENT));
+			copy_individal_page_table(ptbl_old, lookup_pte(as_new, (vaddr_t)i << 22));
+			lock_release(core_map_lock);
 		}
 	}
 }
@@ -1405,32 +3167,57 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_heap_vstart = old->as_heap_vstart;
 	new->as_heap_vtop = old->as_heap_vtop;
 	new->as_stack_vbase = old->as_stack_vbase;
+	new->as_stack_max = old->as_stack_max;
+	new->as_heap_max = old->as_heap_max;
+	// A forked child starts out using what its parent does
+	new->as_ws_pages = old->as_ws_pages;
 	new->data_filesize = old->data_filesize;
 	new->data_memsize = old->data_memsize;
 	new->data_offset = old->data_offset;
 	new->executable_filesize = old->executable_filesize;
 	new->executable_memsize = old->executable_memsize;
 	new->executable_offset = old->executable_offset;
-	strcpy(new->exec_path, old->exec_path);
+	new->as_vnode = old->as_vnode;
+	if(new->as_vnode != NULL)
+	{
+		VOP_INCOPEN(new->as_vnode);
+		VOP_INCREF(new->as_vnode);
+	}
 	if (as_prepare_load(new)) {
 		as_destroy(new);
 		return ENOMEM;
 	}
 
+	// The child maps the same files at the same places. Each one is
+	// filled in before it is linked in, others may be looking
+	struct vm_mapping *mm, *copy, **tail = &new->as_mmaps;
+	for(mm = old->as_mmaps; mm != NULL; mm = mm->mm_next)
+	{
+		copy = kmalloc(sizeof(struct vm_mapping));
+		if(copy == NULL)
+		{
+			as_destroy(new);
+			return ENOMEM;
+		}
+		memcpy(copy, mm, sizeof(struct vm_mapping));
+		copy->mm_next = NULL;
+		VOP_INCOPEN(mm->mm_vnode);
+		VOP_INCREF(mm->mm_vnode);
+		*tail = copy;
+		tail = &copy->mm_next;
+	}
+
 
 	/*
-	 * We now need to walk through the page table and allocate
-	 * and copy pages for the new addrspace. We also need to
-	 * update the entries of the new addrspace page table.
-	 */
-	/*
-	 * Doesn't do copy on write yet. Unfortunately
-	 * forktest won't pass without that I think. This
-	 * is because it spawns too many processes which
-	 * have shared code pages.
+	 * We now need to walk through the page table and copy
+	 * the entries to the new addrspace page table. Pages are
+	 * shared copy-on-write, so nothing gets copied until
+	 * somebody writes to it.
 	 */
 	int spl = splhigh();
 	copy_all_page_tables(old, new);
+	// Our writable TLB entries may now be copy-on-write
+	tlb_flush_asid(old);
 	splx(spl);
 
 
@@ -1460,6 +3247,28 @@ void free_page_tables_in_dir(struct page_table *ptbl, int *allocated_pages)
 }
 #endif
 
+/*
+ * Let go of all the frames and swap sections referenced by a page table
+ * of a dying address space
+ */
+static void release_page_table(struct addrspace *as, struct page_table *ptbl)
+{
+	int i;
+	for(i = 0; i < 1024; ++i)
+	{
+		int32_t entry = ptbl[i].pg_tbl_entry;
+		ptbl[i].pg_tbl_entry = 0;
+		if(entry & PGTBL_VALID_MASK)
+		{
+			release_frame(as, ((entry & PAGE_FRAME) - free_paddr) / PAGE_SIZE);
+		}
+		else if(entry & PF_L)
+		{
+			swap_free_slot(PGTBL_SWAP_SLOT(entry));
+		}
+	}
+}
+
 void
 as_destroy(struct addrspace *as)
 {
@@ -1467,39 +3276,84 @@ as_destroy(struct addrspace *as)
 	 * Walk through the page table. Invalidate the entries.
 	 * Free the pages. Update the coremap.
 	 */
-
-	// Walk through the core map and free all
-	// pages with this address space
 	int i;
+	struct addrspace **prev;
 	lock_acquire(core_map_lock);
-	for(i = 0; i < num_pages; ++i)
+
+	// Page tables that were swapped out are brought back in first. Their
+	// pages may still be in swap. Doing that can evict pages of ours, so
+	// we stay on the address space list until we are done
+	for(i = 0; i < 1024; ++i)
 	{
-		if(pages[i].as == as)
+		if(as->pg_dir[i].pg_dir_entry & PGDIR_LOADED)
 		{
-			pages[i].as = NULL;
-			pages[i].flags = 0;
+			struct page_table *ptbl = get_pte(as, (vaddr_t)i << 22);
+			paddr_t ptbl_addr = as->pg_dir[i].pg_dir_entry & PAGE_FRAME;
+			release_page_table(as, ptbl);
+			as->pg_dir[i].pg_dir_entry = 0;
+			coremap_free_run((ptbl_addr - free_paddr) / PAGE_SIZE, 1);
 		}
 	}
-	// Free all our swapped pages
-	swap_free_pages(as);
+
+	for(prev = &as_list; *prev != as; prev = &(*prev)->as_next)
+	{
+		assert(*prev != NULL);
+	}
+	*prev = as->as_next;
+	if(as->as_suspended)
+	{
+		ws_nsuspended--;
+	}
 	lock_release(core_map_lock);
-	kfree(as->pg_dir);
-	kfree(as);
+
+	if(as->as_vnode != NULL)
+	{
+		vfs_close(as->as_vnode);
+	}
+
+	// All our pages are gone (shared ones written back), so nobody
+	// looks at our mappings anymore
+	while(as->as_mmaps != NULL)
+	{
+		struct vm_mapping *mm = as->as_mmaps;
+		as->as_mmaps = mm->mm_next;
+		vfs_close(mm->mm_vnode);
+		kfree(mm);
+	}
+
+	// Our ASID isn't handed out again before the next generation, but
+	// don't leave our entries taking up TLB slots
+	tlb_flush_asid(as);
+	if(utlb_pgdir == as->pg_dir)
+	{
+		utlb_pgdir = NULL;
+	}
+
+	// Every entry is 0 again, the way the cache hands them out
+	slab_free(&pg_dir_cache, as->pg_dir);
+	slab_free(&as_cache, as);
 }
 
 void
 as_activate(struct addrspace *as)
 {
-	int i, spl;
-
-	(void)as;
+	int spl;
 
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		TLB_Write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if(!as_has_asid(as))
+	{
+		if(next_asid == NUM_TLB_PID)
+		{
+			// Ran out of ASIDs. Nobody's entries can be trusted anymore
+			tlb_flush();
+			asid_generation++;
+			next_asid = 0;
+		}
+		as->as_asid = next_asid++;
+		as->as_asid_gen = asid_generation;
 	}
-
+	TLB_SetPID(as->as_asid);
+	utlb_pgdir = as->pg_dir;
 	splx(spl);
 }
 
@@ -1599,3 +3453,458 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 }
 
 
+/*
+ * Map 'len' bytes of file 'v' from 'offset' (a multiple of the page size)
+ * at the lowest free address between VM_MMAP_BASE and VM_MMAP_TOP. 'prot'
+ * is in PF_ flags and 'flags' is MAP_SHARED or MAP_PRIVATE. Nothing is
+ * read until the pages are touched. The mapping holds the file open.
+ */
+int
+as_mmap(struct addrspace *as, size_t len, int32_t prot, int flags,
+		struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct vm_mapping *mm, **link;
+	size_t npages;
+	vaddr_t start;
+
+	if(len == 0 || offset < 0 || (offset & ~PAGE_FRAME) ||
+			(flags != MAP_SHARED && flags != MAP_PRIVATE))
+	{
+		return EINVAL;
+	}
+	npages = len / PAGE_SIZE + ((len % PAGE_SIZE) != 0);
+	if(npages > (VM_MMAP_TOP - VM_MMAP_BASE) / PAGE_SIZE)
+	{
+		return ENOMEM;
+	}
+
+	mm = kmalloc(sizeof(struct vm_mapping));
+	if(mm == NULL)
+	{
+		return ENOMEM;
+	}
+	mm->mm_npages = npages;
+	mm->mm_prot = prot;
+	mm->mm_flags = flags;
+	mm->mm_vnode = v;
+	mm->mm_offset = offset;
+	VOP_INCOPEN(v);
+	VOP_INCREF(v);
+
+	lock_acquire(core_map_lock);
+	// First fit. The list is in address order
+	start = VM_MMAP_BASE;
+	for(link = &as->as_mmaps; *link != NULL; link = &(*link)->mm_next)
+	{
+		if((*link)->mm_start - start >= npages * PAGE_SIZE)
+		{
+			break;
+		}
+		start = (*link)->mm_start + (*link)->mm_npages * PAGE_SIZE;
+	}
+	if(*link == NULL && VM_MMAP_TOP - start < npages * PAGE_SIZE)
+	{
+		lock_release(core_map_lock);
+		vfs_close(v);
+		kfree(mm);
+		return ENOMEM;
+	}
+	mm->mm_start = start;
+	mm->mm_next = *link;
+	*link = mm;
+	lock_release(core_map_lock);
+
+	*ret = start;
+	return 0;
+}
+
+/*
+ * Let go of the page of 'as' at 'vpn', which is being unmapped or is no
+ * longer part of the heap. The core map must be locked.
+ */
+static void release_user_page(struct addrspace *as, vaddr_t vpn)
+{
+	struct page_table *pte;
+	int32_t entry;
+
+	if(!(as->pg_dir[vpn >> 22].pg_dir_entry & PGDIR_LOADED))
+	{
+		// Never touched
+		return;
+	}
+	pte = get_pte(as, vpn);
+	entry = pte->pg_tbl_entry;
+	pte->pg_tbl_entry = 0;
+	if(entry & PGTBL_VALID_MASK)
+	{
+		tlb_invalidate_vpn(as, vpn);
+		release_frame(as, ((entry & PAGE_FRAME) - free_paddr) / PAGE_SIZE);
+	}
+	else if(entry & PF_L)
+	{
+		swap_free_slot(PGTBL_SWAP_SLOT(entry));
+	}
+}
+
+/*
+ * Unmap the pages of 'as' from 'vaddr' (page aligned) for 'len' bytes.
+ * Written pages of shared mappings are written back once nobody has them
+ * mapped anymore. Mappings partly in the range are trimmed, or split in
+ * two if the range is in the middle. Pages in the range that aren't mapped
+ * are ignored.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_mapping *mm, *spare, *dead = NULL, **link;
+	vaddr_t end, mm_end, from, to, v;
+	int split = 0;
+
+	end = vaddr + len / PAGE_SIZE * PAGE_SIZE + ((len % PAGE_SIZE) ? PAGE_SIZE : 0);
+	if((vaddr & ~PAGE_FRAME) || len == 0 || end < vaddr)
+	{
+		return EINVAL;
+	}
+
+	// In case a mapping gets split. Not something to allocate with the
+	// core map locked
+	spare = kmalloc(sizeof(struct vm_mapping));
+	if(spare == NULL)
+	{
+		return ENOMEM;
+	}
+
+	lock_acquire(core_map_lock);
+
+	// The pages go first. Their mappings tell where they belong in the
+	// file until they are gone
+	for(mm = as->as_mmaps; mm != NULL; mm = mm->mm_next)
+	{
+		mm_end = mm->mm_start + mm->mm_npages * PAGE_SIZE;
+		from = (mm->mm_start > vaddr) ? mm->mm_start : vaddr;
+		to = (mm_end < end) ? mm_end : end;
+		for(v = from; v < to; v += PAGE_SIZE)
+		{
+			release_user_page(as, v);
+		}
+	}
+
+	link = &as->as_mmaps;
+	while((mm = *link) != NULL)
+	{
+		mm_end = mm->mm_start + mm->mm_npages * PAGE_SIZE;
+		if(mm_end <= vaddr || mm->mm_start >= end)
+		{
+			link = &mm->mm_next;
+		}
+		else if(mm->mm_start < vaddr && mm_end > end)
+		{
+			// A hole in the middle. The part above it becomes a
+			// mapping of its own
+			memcpy(spare, mm, sizeof(struct vm_mapping));
+			spare->mm_start = end;
+			spare->mm_offset = mm->mm_offset + (end - mm->mm_start);
+			spare->mm_npages = (mm_end - end) / PAGE_SIZE;
+			mm->mm_npages = (vaddr - mm->mm_start) / PAGE_SIZE;
+			mm->mm_next = spare;
+			link = &spare->mm_next;
+			split = 1;
+		}
+		else if(mm->mm_start < vaddr)
+		{
+			mm->mm_npages = (vaddr - mm->mm_start) / PAGE_SIZE;
+			link = &mm->mm_next;
+		}
+		else if(mm_end > end)
+		{
+			mm->mm_offset += end - mm->mm_start;
+			mm->mm_npages = (mm_end - end) / PAGE_SIZE;
+			mm->mm_start = end;
+			link = &mm->mm_next;
+		}
+		else
+		{
+			*link = mm->mm_next;
+			mm->mm_next = dead;
+			dead = mm;
+		}
+	}
+	lock_release(core_map_lock);
+
+	if(split)
+	{
+		// Both halves hold the file open
+		VOP_INCOPEN(spare->mm_vnode);
+		VOP_INCREF(spare->mm_vnode);
+	}
+	else
+	{
+		kfree(spare);
+	}
+	while(dead != NULL)
+	{
+		mm = dead;
+		dead = mm->mm_next;
+		vfs_close(mm->mm_vnode);
+		kfree(mm);
+	}
+	return 0;
+}
+
+/*
+ * Move the heap top of 'as' down to 'new_top'. The frames and swap
+ * sections of the pages that are no longer in the heap at all are given
+ * back. If the heap grows over them again they start off zeroed.
+ */
+void
+as_shrink_heap(struct addrspace *as, vaddr_t new_top)
+{
+	vaddr_t v, start, end;
+
+	assert(new_top >= as->as_heap_vstart && new_top <= as->as_heap_vtop);
+	start = (new_top + PAGE_SIZE - 1) & PAGE_FRAME;
+	end = (as->as_heap_vtop + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	lock_acquire(core_map_lock);
+	as->as_heap_vtop = new_top;
+	for(v = start; v < end; v += PAGE_SIZE)
+	{
+		release_user_page(as, v);
+	}
+	lock_release(core_map_lock);
+}
+
+/*
+ * The shared file page in core map entry 'index' has been written back.
+ * Take write access away from everybody mapping it, so the next write
+ * marks it dirty again. The core map must be locked.
+ */
+static void page_cleaned(int index)
+{
+	paddr_t page_addr = free_paddr + index * PAGE_SIZE;
+	struct addrspace *sharer;
+	struct page_table *pte;
+	vaddr_t v;
+
+	pages[index].flags &= ~PFLAG_DIRTY;
+	for(sharer = as_list; sharer != NULL; sharer = sharer->as_next)
+	{
+		for(v = frame_vpn_in(sharer, index, 0); v != 0; v = frame_vpn_in(sharer, index, v))
+		{
+			pte = lookup_pte(sharer, v);
+			if(pte != NULL && (pte->pg_tbl_entry & PGTBL_VALID_MASK) &&
+					(pte->pg_tbl_entry & PAGE_FRAME) == page_addr)
+			{
+				pte->pg_tbl_entry &= ~PGTBL_MOD_MASK;
+				tlb_invalidate_vpn(sharer, v);
+			}
+		}
+	}
+}
+
+/*
+ * Write the written pages of shared mappings of 'as' from 'vaddr' (page
+ * aligned) for 'len' bytes back to their files. Returns ENOMEM if part of
+ * the range isn't mapped, EIO if a page couldn't be written (it stays
+ * dirty).
+ */
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct vm_mapping *mm;
+	vaddr_t end, v;
+	int index, result = 0;
+
+	end = vaddr + len / PAGE_SIZE * PAGE_SIZE + ((len % PAGE_SIZE) ? PAGE_SIZE : 0);
+	if((vaddr & ~PAGE_FRAME) || end < vaddr)
+	{
+		return EINVAL;
+	}
+
+	lock_acquire(core_map_lock);
+	for(v = vaddr; v < end; v += PAGE_SIZE)
+	{
+		mm = mapping_find(as, v);
+		if(mm == NULL)
+		{
+			result = ENOMEM;
+			break;
+		}
+		index = resident_page_index(as, v);
+		if(mm->mm_flags == MAP_SHARED && index != -1 && (pages[index].flags & PFLAG_DIRTY))
+		{
+			// Take write access away first. A write while VOP_WRITE
+			// sleeps faults, waits for the core map in
+			// page_dirtied_fault and dirties the page again
+			page_cleaned(index);
+			if(mapping_write_page(index))
+			{
+				pages[index].flags |= PFLAG_DIRTY;
+				result = EIO;
+			}
+		}
+	}
+	lock_release(core_map_lock);
+
+	return result;
+}
+
+
+/*
+ * VM tunables. Set from the kernel menu with "vmtune name value"
+ */
+static struct {
+	const char *name;
+	int *value;
+	int min, max;
+	const char *desc;
+} vm_tunables[] = {
+	{ "policy", &vm_replace_policy, VM_POLICY_RANDOM, VM_POLICY_CLOCK,
+			"Page replacement (0 random, 1 clock)" },
+	{ "pageout_low", &pageout_low, 0, 4096,
+			"Wake the pageout daemon below this many free pages" },
+	{ "pageout_high", &pageout_high, 0, 4096,
+			"Pageout daemon stops at this many free pages" },
+	{ "swap_cluster", &swap_cluster_pages, 1, SWAP_CLUSTER_MAX,
+			"Most pages written to swap in one request" },
+	{ "swap_readahead", &swap_readahead_pages, 0, SWAP_CLUSTER_MAX - 1,
+			"Most pages read ahead on a swap in" },
+	{ "zswap_pages", &swap_zpool_pages, 0, ZSWAP_POOL_PAGES,
+			"Memory for compressed swap, in pages (0 off)" },
+	{ "fault_around", &fault_around_pages, 0, VM_MAX_FAULT_AROUND,
+			"Resident pages after a fault mapped with it" },
+	{ "exec_readahead", &exec_readahead_pages, 0, VM_MAX_FAULT_AROUND,
+			"Most pages loaded ahead from the executable" },
+	{ "stack_max", &stack_max_pages, 1, VM_MAX_STACK_PAGES,
+			"Most stack pages for new processes" },
+	{ "heap_max", &heap_max_pages, 0, VM_MAX_HEAP_PAGES,
+			"Most heap pages for new processes" },
+	{ "stack_prefault", &stack_prefault_pages, 0, VM_MAX_FAULT_AROUND,
+			"Pages given to a growing stack ahead of faults" },
+	{ "ws_window", &ws_window, 0, 4096,
+			"Page-in faults between working set estimates (0 off)" },
+	{ NULL, NULL, 0, 0, NULL }
+};
+
+int
+vm_set_tunable(const char *name, int value)
+{
+	int i;
+	for(i = 0; vm_tunables[i].name != NULL; ++i)
+	{
+		if(!strcmp(vm_tunables[i].name, name))
+		{
+			if(value < vm_tunables[i].min || value > vm_tunables[i].max)
+			{
+				return EINVAL;
+			}
+			*vm_tunables[i].value = value;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+vm_print_tunables(void)
+{
+	int i;
+	for(i = 0; vm_tunables[i].name != NULL; ++i)
+	{
+		kprintf("%-12s %8d   [%d..%d] %s\n", vm_tunables[i].name,
+				*vm_tunables[i].value, vm_tunables[i].min,
+				vm_tunables[i].max, vm_tunables[i].desc);
+	}
+}
+
+/*
+ * Print one set of VM counters
+ */
+static void
+vmstat_print(const struct vmstat *vs)
+{
+	kprintf("Faults:             %u (%u TLB refills)\n", vs->vs_faults,
+			vs->vs_tlb_refills);
+	kprintf("Fast TLB refills:   %u\n", vs->vs_utlb_refills);
+	kprintf("Executable loads:   %u (%u read ahead)\n", vs->vs_page_loads,
+			vs->vs_exec_readaheads);
+	kprintf("Fault-around maps:  %u\n", vs->vs_fault_arounds);
+	kprintf("Stack prefaults:    %u\n", vs->vs_stack_prefaults);
+	kprintf("Page cache maps:    %u\n", vs->vs_page_cache_hits);
+	kprintf("Mapped file pages:  %u read, %u written back\n", vs->vs_mmap_reads,
+			vs->vs_mmap_writes);
+	kprintf("Zero page maps:     %u (%u written later)\n", vs->vs_zero_maps,
+			vs->vs_zero_fills);
+	kprintf("COW breaks:         %u\n", vs->vs_cow_breaks);
+	kprintf("Page table swaps:   %u out, %u in\n", vs->vs_ptbl_swap_outs,
+			vs->vs_ptbl_swap_ins);
+	kprintf("Swap ins:           %u (%u reads, %u read ahead)\n", vs->vs_swap_ins,
+			vs->vs_swap_reads, vs->vs_readaheads);
+	kprintf("Evictions:          %u (%u clock, %u random, %u pageout)\n",
+			vs->vs_evictions, vs->vs_clock_evictions,
+			vs->vs_random_evictions, vs->vs_pageout_evictions);
+	kprintf("Swap outs:          %u (%u writes)\n", vs->vs_swap_outs,
+			vs->vs_swap_writes);
+	kprintf("Compressed swap:    %u stored, %u loaded, %u spilled to disk\n",
+			vs->vs_zswap_stores, vs->vs_zswap_loads, vs->vs_zswap_spills);
+	kprintf("Compressed pool:    %u pages in %u bytes\n", vs->vs_zswap_pages,
+			vs->vs_zswap_bytes);
+	kprintf("Clock second chances: %u\n", vs->vs_ref_clears);
+	kprintf("Pageout runs:       %u\n", vs->vs_pageout_runs);
+	kprintf("Working sets:       %u estimates, %u suspends, %u resumes\n",
+			vs->vs_ws_checks, vs->vs_ws_suspends, vs->vs_ws_resumes);
+}
+
+void
+vm_printstats(void)
+{
+	struct addrspace *as;
+	struct vmstat vs;
+
+	kprintf("Replacement policy: %s\n",
+			vm_replace_policy == VM_POLICY_CLOCK ? "clock" : "random");
+	kprintf("Free pages:         %d of %d\n", num_free_pages, num_pages);
+	kprintf("Zero page mappings: %d\n",
+			pages[(zero_page - free_paddr) / PAGE_SIZE].refcount - 1);
+	kprintf("Kernel virtual:     %d of %d pages\n", kva_used_pages, KVA_PAGES);
+	vm_getstats(NULL, VMSTAT_SYSTEM, &vs);
+	vmstat_print(&vs);
+
+	lock_acquire(core_map_lock);
+	if(as_list != NULL)
+	{
+		kprintf("\nAddress space  faults  refills   loads  zero  cow  swapin  evicted  wset\n");
+	}
+	for(as = as_list; as != NULL; as = as->as_next)
+	{
+		kprintf("0x%08x   %7u  %7u  %6u  %4u  %3u  %6u  %7u  %4u%s\n", (u_int32_t)as,
+				as->as_stats.vs_faults, as->as_stats.vs_tlb_refills,
+				as->as_stats.vs_page_loads + as->as_stats.vs_mmap_reads,
+				as->as_stats.vs_zero_fills, as->as_stats.vs_cow_breaks,
+				as->as_stats.vs_swap_ins, as->as_stats.vs_evictions,
+				as->as_ws_pages, as->as_suspended ? " suspended" : "");
+	}
+	lock_release(core_map_lock);
+}
+
+/*
+ * Copy the VM counters of the system (VMSTAT_SYSTEM) or of 'as'
+ * (VMSTAT_SELF) to 'vs'
+ */
+int
+vm_getstats(struct addrspace *as, int which, struct vmstat *vs)
+{
+	switch(which)
+	{
+	case VMSTAT_SYSTEM:
+		memcpy(vs, &vmstats, sizeof(struct vmstat));
+		vs->vs_utlb_refills = utlb_refills;
+		swap_getstats(vs);
+		return 0;
+	case VMSTAT_SELF:
+		memcpy(vs, &as->as_stats, sizeof(struct vmstat));
+		return 0;
+	default:
+		return EINVAL;
+	}
+}
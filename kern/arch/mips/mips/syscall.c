@@ -16,6 +16,10 @@
 #include <vfs.h>
 #include <vm.h>
 #include <machine/vm.h>
+#include <vnode.h>
+#include <elf.h>
+#include <kern/vmstat.h>
+#include <slab.h>
 
 /*
  * Child Process Info. This structure contains the only fields a parent needs to
@@ -28,6 +32,23 @@ struct childprocinfo
 	struct thread *child_process_ptr;
 };
 
+/*
+ * Every fork takes a trapframe copy for the child and a childprocinfo
+ * for the parent, so keep them cached
+ */
+static struct slab_cache trapframe_cache =
+	SLAB_CACHE_INITIALIZER("trapframe", sizeof(struct trapframe), NULL, NULL);
+static struct slab_cache childprocinfo_cache =
+	SLAB_CACHE_INITIALIZER("childprocinfo", sizeof(struct childprocinfo),
+			       NULL, NULL);
+
+static
+void
+childprocinfo_destroy(void *cpi)
+{
+	slab_free(&childprocinfo_cache, cpi);
+}
+
 
 /*
  * System call handler.
@@ -125,6 +146,29 @@ mips_syscall(struct trapframe *tf)
 	    case SYS_sbrk:
 	    	err = sys_sbrk(tf->tf_a0, &retval);
 	    	break;
+
+	    // Files are only good for mapping into memory with mmap for now.
+	    // read and write still only handle the console
+	    case SYS_open:
+	    	err = sys_open(tf, &retval);
+	    	break;
+	    case SYS_close:
+	    	err = sys_close(tf->tf_a0);
+	    	break;
+	    case SYS_mmap:
+	    	err = sys_mmap(tf, &retval);
+	    	break;
+	    case SYS_munmap:
+	    	err = sys_munmap(tf);
+	    	break;
+	    case SYS_msync:
+	    	err = sys_msync(tf);
+	    	break;
+
+	    // VM counters, for tuning the VM system from userland
+	    case SYS_vmstat:
+	    	err = sys_vmstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+	    	break;
  
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -186,17 +230,6 @@ int sys_waitpid(void *ptr, int pid, int *status)
 		return 0;
 	}
 
-	if(curthread->t_vmspace != NULL)
-	{
-		evict_all_my_pages_if_necessary(curthread->t_vmspace);
-	}
-
-	if(child_process_info->has_exited)
-	{
-		*status = child_process_info->exit_code;
-		splx(spl);
-		return 0;
-	}
 	// Sleep on this child till he exits...sounds wrong :/
 	thread_sleep(child_process_info->child_process_ptr);
 	splx(spl);
@@ -268,10 +301,10 @@ void cleanup_children()
 		next = li->next;
 		sys_waitpid((void*)curthread, li->key, &status);
 		list_remove(curthread->children, li->key, (void**)&cpi);
-		kfree(cpi);
+		childprocinfo_destroy(cpi);
 		li = next;
 	}
-	list_destroy(&curthread->children, kfree);
+	list_destroy(&curthread->children, childprocinfo_destroy);
 }
 
 int sys_exit(struct trapframe *tf)
@@ -302,8 +335,8 @@ void child_fork(void *child_tf, unsigned long addr_space)
 	assert(curthread->is_user_process == 1);
 	// Copy the passed in trap frame into our stack
 	memcpy(&my_tf, child_tf, sizeof(struct trapframe));
-	// Free the kernel heap for the trap frame
-	kfree((struct trapframe*)child_tf);
+	// Give the trap frame back to its cache
+	slab_free(&trapframe_cache, child_tf);
 
 	// Now lets copy le address space and activate it
 	assert(curthread->t_vmspace == NULL);
@@ -337,7 +370,7 @@ md_forkentry(struct trapframe *tf, int *retval)
 
 	// Create a copy of the trap frame (current state) of the parent
 	// which we will pass to to child
-	struct trapframe *child_tf = kmalloc(sizeof(struct trapframe));
+	struct trapframe *child_tf = slab_alloc(&trapframe_cache);
 	if(child_tf == NULL)
 	{
 		return ENOMEM;
@@ -348,7 +381,7 @@ md_forkentry(struct trapframe *tf, int *retval)
 	struct addrspace *child_addrspace;
 	if(as_copy(curthread->t_vmspace, &child_addrspace))
 	{
-		kfree(child_tf);
+		slab_free(&trapframe_cache, child_tf);
 		return ENOMEM;
 	}
 
@@ -356,7 +389,7 @@ md_forkentry(struct trapframe *tf, int *retval)
 	if(new_thread == NULL)
 	{
 		as_destroy(child_addrspace);
-		kfree(child_tf);
+		slab_free(&trapframe_cache, child_tf);
 		return ENOMEM;
 	}
 
@@ -368,7 +401,7 @@ md_forkentry(struct trapframe *tf, int *retval)
 		if(curthread->children == NULL)
 		{
 			as_destroy(child_addrspace);
-			kfree(child_tf);
+			slab_free(&trapframe_cache, child_tf);
 			thread_destroy(new_thread);
 			splx(spl);
 			return ENOMEM;
@@ -376,11 +409,11 @@ md_forkentry(struct trapframe *tf, int *retval)
 	}
 
 	// Now create the info about this child that the parent will need later
-	cpi = kmalloc(sizeof(struct childprocinfo));
+	cpi = slab_alloc(&childprocinfo_cache);
 	if(cpi == NULL)
 	{
 		as_destroy(child_addrspace);
-		kfree(child_tf);
+		slab_free(&trapframe_cache, child_tf);
 		thread_destroy(new_thread);
 		splx(spl);
 		return ENOMEM;
@@ -393,8 +426,8 @@ md_forkentry(struct trapframe *tf, int *retval)
 	if(list_insert(curthread->children, *retval, cpi))
 	{
 		as_destroy(child_addrspace);
-		kfree(child_tf);
-		kfree(cpi);
+		slab_free(&trapframe_cache, child_tf);
+		childprocinfo_destroy(cpi);
 		thread_destroy(new_thread);
 		splx(spl);
 		return ENOMEM;
@@ -403,15 +436,29 @@ md_forkentry(struct trapframe *tf, int *retval)
 			child_fork, new_thread))
 	{
 		DEBUG(DB_SYSCALL, "thread_fork failed.\n");
-		kfree(child_tf);
+		slab_free(&trapframe_cache, child_tf);
 		as_destroy(child_addrspace);
 		// No need to free thread as it is already taken care of by thread_fork_nalloc
-		kfree(cpi);
+		list_remove(curthread->children, *retval, (void**)&cpi);
+		childprocinfo_destroy(cpi);
 		splx(spl);
 		return ENOMEM;
 	}
 	new_thread->pid = *retval;
 	new_thread->is_user_process = 1;
+
+	// The child gets its own hold on each of our open files
+	int fd;
+	for(fd = 0; fd < OPEN_MAX; ++fd)
+	{
+		if(curthread->t_files[fd] != NULL)
+		{
+			VOP_INCOPEN(curthread->t_files[fd]);
+			VOP_INCREF(curthread->t_files[fd]);
+			new_thread->t_files[fd] = curthread->t_files[fd];
+			new_thread->t_file_flags[fd] = curthread->t_file_flags[fd];
+		}
+	}
 	splx(spl);
 
 	return 0;
@@ -438,11 +485,10 @@ int sys_execv(struct trapframe *tf)
 		return EFAULT;
 	}
 
-	char ptr[NAME_MAX], name_copy_2[NAME_MAX];
+	char ptr[NAME_MAX];
 	int error;
 	size_t actual;
 	error = copyinstr((const_userptr_t)tf->tf_a0,ptr,NAME_MAX,&actual);
-	strcpy(name_copy_2, ptr);
 	if(error)
 	{
 		return error;
@@ -562,9 +608,6 @@ int sys_execv(struct trapframe *tf)
 
 	as_destroy(old_addr_space);
 
-
-	assert(strlen(name_copy_2) < MAX_EXEC_PATH_SIZE);
-	strcpy(curthread->t_vmspace->exec_path, name_copy_2);
 	/* Activate it. */
 	as_activate(curthread->t_vmspace);
 
@@ -656,24 +699,196 @@ sys_sbrk (int amount, int *retval)
 		return ENOMEM;
 	}
 
-	if(old_heap_vtop + amount - curthread->t_vmspace->as_heap_vstart > USER_HEAP_MAX)
+	if(old_heap_vtop + amount - curthread->t_vmspace->as_heap_vstart >
+			curthread->t_vmspace->as_heap_max * PAGE_SIZE ||
+			old_heap_vtop + amount > VM_MMAP_BASE)
 	{
 		*retval = -1;
 		return ENOMEM;
 	}
 
-	curthread->t_vmspace->as_heap_vtop += amount;
+	if(amount < 0)
+	{
+		// Give the memory back now rather than when we exit
+		as_shrink_heap(curthread->t_vmspace, old_heap_vtop + amount);
+	}
+	else
+	{
+		curthread->t_vmspace->as_heap_vtop += amount;
+	}
 	*retval = old_heap_vtop;
 
 	return 0;
 }
 
+/*
+ * Open a file and hand back the lowest free file handle after the console's
+ */
+int
+sys_open(struct trapframe *tf, int *retval)
+{
+	char *path;
+	struct vnode *v;
+	size_t actual;
+	int fd, result;
+
+	for(fd = STDERR_FILENO + 1; fd < OPEN_MAX && curthread->t_files[fd] != NULL; ++fd);
+	if(fd == OPEN_MAX)
+	{
+		return EMFILE;
+	}
+
+	path = kmalloc(PATH_MAX);
+	if(path == NULL)
+	{
+		return ENOMEM;
+	}
+	result = copyinstr((const_userptr_t)tf->tf_a0, path, PATH_MAX, &actual);
+	if(result == 0)
+	{
+		result = vfs_open(path, tf->tf_a1, &v);
+	}
+	kfree(path);
+	if(result)
+	{
+		return result;
+	}
+
+	curthread->t_files[fd] = v;
+	curthread->t_file_flags[fd] = tf->tf_a1;
+	*retval = fd;
+	return 0;
+}
+
+int
+sys_close(int fd)
+{
+	if(fd < 0 || fd >= OPEN_MAX || curthread->t_files[fd] == NULL)
+	{
+		return EBADF;
+	}
+	// Mappings of the file hold it open themselves
+	vfs_close(curthread->t_files[fd]);
+	curthread->t_files[fd] = NULL;
+	return 0;
+}
+
+/*
+ * mmap(addr, len, prot, flags, fd, offset). The address is only a hint
+ * and is ignored, the kernel picks where the file goes.
+ *
+ * EBADF 	fd isn't an open file, or isn't open for reading (or writing,
+ * 		for a writable shared mapping).
+ * ENODEV 	The file can't be mapped (a device, say).
+ * EINVAL 	len is 0, offset isn't page aligned, prot has bits other
+ * 		than the PROT_ ones or flags isn't one of MAP_SHARED and
+ * 		MAP_PRIVATE.
+ * ENOMEM 	No room for the mapping.
+ * EFAULT 	The arguments on the user stack couldn't be read.
+ */
+int
+sys_mmap(struct trapframe *tf, int *retval)
+{
+	size_t len = tf->tf_a1;
+	int prot = tf->tf_a2;
+	int flags = tf->tf_a3;
+	int fd, accmode, result;
+	int32_t pf_prot = 0;
+	off_t offset;
+	struct vnode *v;
+	vaddr_t addr;
 
+	// The fifth and sixth arguments are on the user stack, past the room
+	// the caller leaves there for the first four
+	result = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(int));
+	if(result == 0)
+	{
+		result = copyin((const_userptr_t)(tf->tf_sp + 20), &offset, sizeof(off_t));
+	}
+	if(result)
+	{
+		return result;
+	}
 
+	if(fd < 0 || fd >= OPEN_MAX || curthread->t_files[fd] == NULL)
+	{
+		return EBADF;
+	}
+	v = curthread->t_files[fd];
+	accmode = curthread->t_file_flags[fd] & O_ACCMODE;
+	if(accmode == O_WRONLY ||
+			(flags == MAP_SHARED && (prot & PROT_WRITE) && accmode != O_RDWR))
+	{
+		return EBADF;
+	}
+	if(VOP_MMAP(v))
+	{
+		return ENODEV;
+	}
 
+	if(prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+	{
+		return EINVAL;
+	}
+	if(prot & PROT_READ)
+	{
+		pf_prot |= PF_R;
+	}
+	if(prot & PROT_WRITE)
+	{
+		pf_prot |= PF_W;
+	}
+	if(prot & PROT_EXEC)
+	{
+		pf_prot |= PF_X;
+	}
 
+	result = as_mmap(curthread->t_vmspace, len, pf_prot, flags, v, offset, &addr);
+	if(result)
+	{
+		return result;
+	}
+	*retval = addr;
+	return 0;
+}
 
+int
+sys_munmap(struct trapframe *tf)
+{
+	return as_munmap(curthread->t_vmspace, tf->tf_a0, tf->tf_a1);
+}
 
+/*
+ * msync(addr, len, flags). The pages are always written before returning,
+ * whatever the flags say.
+ */
+int
+sys_msync(struct trapframe *tf)
+{
+	int flags = tf->tf_a2;
 
+	if((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) ||
+			((flags & MS_ASYNC) && (flags & MS_SYNC)))
+	{
+		return EINVAL;
+	}
+	return as_msync(curthread->t_vmspace, tf->tf_a0, tf->tf_a1);
+}
 
+/*
+ * vmstat(which, buf). Copies out the system's VM counters or the calling
+ * process's own (see kern/vmstat.h).
+ */
+int
+sys_vmstat(int which, userptr_t buf)
+{
+	struct vmstat vs;
+	int result;
 
+	result = vm_getstats(curthread->t_vmspace, which, &vs);
+	if(result)
+	{
+		return result;
+	}
+	return copyout(&vs, buf, sizeof(struct vmstat));
+}
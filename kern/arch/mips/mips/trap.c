@@ -114,6 +114,15 @@ mips_trap(struct trapframe *tf)
 	 * Panic on the bus error exceptions.
 	 */
 	int result;
+
+	/*
+	 * A process suspended to make room for the others' working sets
+	 * stops at its next fault from user mode.
+	 */
+	if (!iskern && (code == EX_MOD || code == EX_TLBL || code == EX_TLBS)) {
+		vm_ws_wait();
+	}
+
 	switch (code) {
 	case EX_MOD:
 		result = vm_fault(VM_FAULT_READONLY, tf->tf_vaddr);
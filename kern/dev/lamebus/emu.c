@@ -673,6 +673,20 @@ emufs_fsync(struct vnode *v)
 	return 0;
 }
 
+/*
+ * VOP_MMAP
+ *
+ * Mapped files are paged in and out with VOP_READ and VOP_WRITE, so
+ * there is nothing to set up.
+ */
+static
+int
+emufs_mmap(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
 /*
  * VOP_TRUNCATE
  */
@@ -853,7 +867,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_file_gettype,
 	emufs_tryseek,
 	emufs_fsync,
-	UNIMP,   /* mmap */
+	emufs_mmap,
 	emufs_truncate,
 	NOTDIR,  /* namefile */
 
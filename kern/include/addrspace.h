@@ -2,10 +2,28 @@
 #define _ADDRSPACE_H_
 
 #include <vm.h>
+#include <kern/vmstat.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
 
+/*
+ * A file mapped into an address space with mmap. Its pages are loaded from
+ * the file when they are first touched. Pages of a MAP_SHARED mapping are
+ * shared with everybody mapping the same part of the file and are written
+ * back to it. Pages of a MAP_PRIVATE mapping are the mapper's own and go
+ * to swap like any other anonymous page once they are written.
+ */
+struct vm_mapping {
+	vaddr_t mm_start;
+	size_t mm_npages;
+	int32_t mm_prot;	// PF_R, PF_W and PF_X
+	int mm_flags;		// MAP_SHARED or MAP_PRIVATE
+	struct vnode *mm_vnode;	// held open by the mapping
+	off_t mm_offset;	// file offset of mm_start
+	struct vm_mapping *mm_next;
+};
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -13,8 +31,6 @@ struct vnode;
  * You write this.
  */
 
-#define NUM_PTABLES_IN_MEM 3
-#define MAX_EXEC_PATH_SIZE 30
 struct addrspace {
 
 	vaddr_t as_vbase1;
@@ -39,39 +55,66 @@ struct addrspace {
 	// in whichever region requested to grow
 	vaddr_t as_stack_vbase;
 
+	// Most pages the stack may grow to
+	size_t as_stack_max;
+
 	vaddr_t as_heap_vstart;
 	vaddr_t as_heap_vtop;
 
-	/* Path of our executable program */
-	char exec_path[MAX_EXEC_PATH_SIZE];
+	// Most pages the heap may grow to
+	size_t as_heap_max;
+
+	/*
+	 * Our executable program. We hold it open (and so do our forked
+	 * children) so demand loading can read it straight away.
+	 */
+	struct vnode *as_vnode;
 
-	/* Page table directory for each process*/
+	/*
+	 * Page table directory for each process. Page tables are allocated
+	 * from the core map as they are needed.
+	 */
 	struct page_directory *pg_dir;
 
-	/* Page tables we will actually keep in memory */
-	struct page_table ptables_in_mem[NUM_PTABLES_IN_MEM][1024];
+	/*
+	 * Next address space in the list of all address spaces. Used to
+	 * find everybody sharing a copy-on-write frame.
+	 */
+	struct addrspace *as_next;
 
 	/*
-	 * Flags containing info about the page tables
-	 * we keep in memory. Is zero when slot if free.
-	 *
-	 * Upper 10 bits is the virtual page
-	 * directory number for this page table.
-	 * The next bit is indicates whether this page table
-	 * is for an executable directory.
-	 * The next 21 bits
-	 * is a counter that says how many times there was a fault
-	 * requiring this page. The one with the least count is
-	 * a candidate for eviction.
+	 * TLB address space ID. Only good while as_asid_gen matches the
+	 * current ASID generation, otherwise as_activate assigns a new one.
 	 */
-	int32_t page_table_flags[NUM_PTABLES_IN_MEM];
-};
+	u_int32_t as_asid;
+	u_int32_t as_asid_gen;
 
-/*
- * Masks for the page_table_flags above
- */
-#define PINMEM_FLAG_EXECUTABLE_MASK 0x00200000
-#define PINMEM_FLAG_COUNTER_MASK	0x001fffff
+	/*
+	 * Where the next demand load from the executable would be if the
+	 * program is reading through it sequentially. Loads there read the
+	 * following pages ahead.
+	 */
+	vaddr_t as_seq_next;
+
+	/*
+	 * Files mapped with mmap, in address order. Protected by the core
+	 * map lock.
+	 */
+	struct vm_mapping *as_mmaps;
+
+	/*
+	 * Working set estimate in pages, and the faults for pages that
+	 * weren't in memory since it was last made (see ws_update). A
+	 * suspended address space's process waits in vm_fault until there
+	 * is room for its working set. Protected by the core map lock.
+	 */
+	u_int32_t as_ws_pages;
+	u_int32_t as_ws_faults;
+	int as_suspended;
+
+	/* VM counters for this address space (see kern/vmstat.h) */
+	struct vmstat as_stats;
+};
 
 /*
  * Functions in addrspace.c:
@@ -105,6 +148,17 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_mmap   - map LEN bytes of file V from OFFSET at a free address,
+ *                handed back in RET.
+ *
+ *    as_munmap - remove the mappings of the pages in the given range,
+ *                writing back any shared pages that have been written.
+ *
+ *    as_msync  - write back the written shared pages in the given range.
+ *                EIO if one couldn't be written; it stays dirty.
+ *
+ *    as_shrink_heap - lower the heap top, freeing the pages above it.
  */
 
 struct addrspace *as_create(void);
@@ -120,6 +174,12 @@ int               as_define_region(struct addrspace *as,
 int		  as_prepare_load(struct addrspace *as);
 int		  as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_mmap(struct addrspace *as, size_t len, int32_t prot,
+			  int flags, struct vnode *v, off_t offset,
+			  vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+void              as_shrink_heap(struct addrspace *as, vaddr_t new_top);
 
 /*
  * Functions in loadelf.c
@@ -133,7 +193,7 @@ int load_elf(struct vnode *v, vaddr_t *entrypoint);
 /*
  * Load a page from the executable file. This is for on demand loading.
  */
-int load_page_from_executable(char *exec_path, off_t offset, vaddr_t vaddr, paddr_t paddr,
+int load_page_from_executable(struct vnode *v, off_t offset, vaddr_t vaddr, paddr_t paddr,
 	     size_t memsize, size_t filesize);
 
 
@@ -7,5 +7,8 @@
 /* Longest full path name */
 #define PATH_MAX   1024
 
+/* Most files a process can have open at once */
+#define OPEN_MAX   16
+
 
 #endif /* _KERN_LIMITS_H_ */
@@ -34,6 +34,21 @@
 #define SEEK_CUR      1      /* Seek relative to current position in file */
 #define SEEK_END      2      /* Seek relative to end of file */
 
+/* Protection for mmap: PROT_NONE or any of the others */
+#define PROT_NONE     0      /* Pages can't be used */
+#define PROT_READ     1      /* Pages can be read */
+#define PROT_WRITE    2      /* Pages can be written */
+#define PROT_EXEC     4      /* Pages can be executed */
+
+/* Flags for mmap: choose one of these */
+#define MAP_SHARED    1      /* Writes go to the file, seen by all mappers */
+#define MAP_PRIVATE   2      /* Writes are private copy-on-write copies */
+
+/* Flags for msync */
+#define MS_ASYNC      1      /* Schedule the writes (done at once here) */
+#define MS_SYNC       2      /* Write the pages before returning */
+#define MS_INVALIDATE 4      /* Drop other cached copies (nothing to do) */
+
 /* The codes for ioctl are in kern/ioctl.h */
 /* The codes for stat/fstat/lstat are in kern/stat.h */
 
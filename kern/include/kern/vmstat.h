@@ -0,0 +1,54 @@
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+/*
+ * VM counters, as returned by the vmstat system call. The kernel keeps
+ * one set for the whole system and one for each address space. Counters
+ * that are about the system as a whole (the clock, the pageout daemon,
+ * evictions by policy, the compressed swap pool, working set admission,
+ * the fast TLB refill path) are always 0 in an address space's set. Pages
+ * of an address space that get evicted or written back count against it,
+ * whoever's fault made room.
+ */
+struct vmstat {
+	u_int32_t vs_faults;		/* calls to vm_fault */
+	u_int32_t vs_tlb_refills;	/* faults on pages already in memory */
+	u_int32_t vs_utlb_refills;	/* TLB misses refilled without a fault */
+	u_int32_t vs_page_loads;	/* pages demand loaded from the executable */
+	u_int32_t vs_exec_readaheads;	/* of those, loaded ahead of a fault */
+	u_int32_t vs_fault_arounds;	/* TLB entries loaded ahead of a fault */
+	u_int32_t vs_stack_prefaults;	/* stack pages given frames ahead of a fault */
+	u_int32_t vs_page_cache_hits;	/* cached file pages shared instead of loaded */
+	u_int32_t vs_mmap_reads;	/* pages of mapped files read in */
+	u_int32_t vs_mmap_writes;	/* shared pages written back to their files */
+	u_int32_t vs_zero_maps;		/* reads of untouched memory given the zero page */
+	u_int32_t vs_zero_fills;	/* of those, written later and given a frame */
+	u_int32_t vs_cow_breaks;	/* copy-on-write pages copied on a write */
+	u_int32_t vs_swap_ins;
+	u_int32_t vs_swap_reads;	/* disk requests for vs_swap_ins */
+	u_int32_t vs_readaheads;	/* pages swapped in ahead of a fault */
+	u_int32_t vs_evictions;
+	u_int32_t vs_swap_outs;
+	u_int32_t vs_swap_writes;	/* disk requests for vs_swap_outs */
+	u_int32_t vs_ptbl_swap_outs;
+	u_int32_t vs_ptbl_swap_ins;
+	u_int32_t vs_clock_evictions;	/* evictions on a fault, clock policy */
+	u_int32_t vs_random_evictions;	/* evictions on a fault, random policy */
+	u_int32_t vs_ref_clears;	/* second chances given by the clock */
+	u_int32_t vs_pageout_runs;
+	u_int32_t vs_pageout_evictions;
+	u_int32_t vs_ws_checks;		/* working set estimates made */
+	u_int32_t vs_ws_suspends;	/* processes suspended, memory overcommitted */
+	u_int32_t vs_ws_resumes;	/* of those, let back in */
+	u_int32_t vs_zswap_stores;	/* pages swapped out to the compressed pool */
+	u_int32_t vs_zswap_loads;	/* pages swapped in from the compressed pool */
+	u_int32_t vs_zswap_spills;	/* pages sent to disk, pool full or page incompressible */
+	u_int32_t vs_zswap_pages;	/* pages in the compressed pool now */
+	u_int32_t vs_zswap_bytes;	/* what they take compressed */
+};
+
+/* Which counters vmstat returns */
+#define VMSTAT_SYSTEM	0	/* The whole system's */
+#define VMSTAT_SELF	1	/* The calling process's own */
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -86,11 +86,32 @@ u_int32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ * kheap_drain gives back the free blocks kfree keeps handy for the next
+ * kmalloc, for when memory is short.
+ * kmalloc_noprof is kmalloc without the heap profiling, for allocators
+ * that charge the memory to their own callers (the object caches).
  */
 void *kmalloc(size_t sz);
 void kfree(void *ptr);
+void *kmalloc_noprof(size_t sz);
+void kheap_drain(void);
 void kheap_printstats(void);
 
+/*
+ * Kernel heap profiling (the khprof menu command). While it is on,
+ * kmalloc counts allocations by call site. kheap_profile_mark starts a
+ * new generation; kheap_profile_leaks prints the blocks allocated since
+ * that are still allocated. kheap_profile_alloc and kheap_profile_free
+ * let other allocators record their objects the same way.
+ */
+void kheap_profile(int on);
+void kheap_profile_alloc(void *ptr, size_t sz, vaddr_t caller);
+void kheap_profile_free(void *ptr);
+void kheap_profile_reset(void);
+void kheap_profile_print(void);
+void kheap_profile_mark(void);
+void kheap_profile_leaks(void);
+
 /*
  * C string functions. 
  *
@@ -9,7 +9,15 @@
  *                     already on the run queue or sleeping, weird things
  *                     may happen. Returns an error code.
  *
- *     print_run_queue - dump the run queue to the console for debugging.
+ *     make_runnable_woken - same, for a thread that was sleeping. It
+ *                     gets the highest priority.
+ *
+ *     scheduler_tick - called on every hardclock. Returns nonzero if the
+ *                     current thread should yield.
+ *
+ *     print_run_queue - dump the run queues, with each level's quantum and
+ *                     the ticks each thread has left, to the console
+ *                     for debugging.
  *
  *     scheduler_bootstrap - initialize scheduler data 
  *                           (must happen early in boot)
@@ -22,6 +30,8 @@ struct thread;
 
 struct thread *scheduler(void);
 int make_runnable(struct thread *t);
+int make_runnable_woken(struct thread *t);
+int scheduler_tick(void);
 
 void print_run_queue(void);
 
@@ -0,0 +1,74 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches for kernel structures that get allocated and freed a lot
+ * (threads, address spaces, ...).
+ *
+ * A cache hands out objects of one size, carved out of whole pages
+ * (slabs) it gets from alloc_kpages. Freed objects go back to their cache
+ * instead of the kernel heap and are handed out again as they are. The
+ * constructor runs once on every object when its slab is set up, the
+ * destructor when the slab is given back, so objects that are freed in
+ * their constructed state (a page directory with all entries 0, say)
+ * don't need to be set up again on every allocation.
+ *
+ * Objects bigger than SLAB_MAX_SIZE are kmalloc'd one at a time and the
+ * cache keeps up to SLAB_KEEP_BIG free ones around. Each cache keeps at
+ * most one empty slab; slab_reap gives back whatever the caches are
+ * holding on to.
+ *
+ * Caches are defined statically with SLAB_CACHE_INITIALIZER and set
+ * themselves up on their first allocation. All of this runs at splhigh
+ * and may sleep in alloc_kpages, like kmalloc.
+ *
+ * With kernel heap profiling on, each object is charged to the caller of
+ * slab_alloc, like a kmalloc'd block.
+ */
+
+#define SLAB_MAX_SIZE	512
+#define SLAB_KEEP_BIG	4
+
+struct slab;
+
+struct slab_cache {
+	const char *sc_name;
+	size_t sc_size;
+	int (*sc_ctor)(void *obj);	/* 0, or an error to fail the allocation */
+	void (*sc_dtor)(void *obj);
+
+	/* Set up on first use */
+	size_t sc_link;			/* offset of the free list link in an object */
+	size_t sc_stride;		/* bytes an object takes in a slab */
+	int sc_perslab;			/* objects in a slab, 0 until set up */
+	struct slab *sc_partial;	/* slabs with free objects */
+	struct slab *sc_full;		/* slabs without */
+	int sc_nempty;			/* slabs on sc_partial with nothing in use */
+	void *sc_big[SLAB_KEEP_BIG];	/* free objects, big caches */
+	int sc_nbig;
+	struct slab_cache *sc_next;	/* all caches that were set up */
+
+	/* Counters */
+	u_int32_t sc_allocs;
+	u_int32_t sc_inuse;
+	u_int32_t sc_slabs;		/* slabs (big objects) allocated now */
+	u_int32_t sc_grows;		/* slabs (big objects) ever allocated */
+};
+
+#define SLAB_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ .sc_name = (name), .sc_size = (size), \
+	  .sc_ctor = (ctor), .sc_dtor = (dtor) }
+
+/* Get an object from 'sc'. NULL if out of memory or the constructor failed */
+void *slab_alloc(struct slab_cache *sc);
+
+/* Give 'obj' back to 'sc', the cache it came from */
+void slab_free(struct slab_cache *sc, void *obj);
+
+/* Give the empty slabs and free big objects of every cache back */
+void slab_reap(void);
+
+/* Print the caches */
+void slab_printstats(void);
+
+#endif /* _SLAB_H_ */
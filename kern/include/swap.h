@@ -3,30 +3,87 @@
 struct addrspace;
 struct uio;
 struct vnode;
+struct vmstat;
 
 #define SWAP_FILE_NAME "lhd0raw:"
 
+/* Most pages moved to or from the swap disk in one request */
+#define SWAP_CLUSTER_MAX 8
 
 /*
- * Bring a page in from the disk to physical memory
+ * Swapped pages that compress well are kept in a pool of kernel memory
+ * instead of going to the disk, as long as the pool has room. The pool
+ * is allocated at boot. swap_zpool_pages is how much of it may be used
+ * (the "zswap_pages" tunable), 0 sends everything to the disk.
  */
-void swap_in_page(struct addrspace *as, vaddr_t vpn, paddr_t free_page);
+#define ZSWAP_POOL_PAGES 8
+extern int swap_zpool_pages;
 
-void swap_copy_in_page(struct addrspace *as, vaddr_t vpn, paddr_t free_page);
 
 /*
- * Free the pages on disk corresponding to this address space
+ * Swap sections are reference counted. A swapped page is found through
+ * the section number kept in its page table entry, and a parent and its
+ * forked children share the sections of pages that were on disk at fork
+ * time.
  */
-void swap_free_pages(struct addrspace *as);
 
 /*
- * Swap a page from physical memory to disk
+ * Bring a page in from the disk to physical memory. The caller's
+ * reference to the section is left alone, so the section stays a valid
+ * copy of the page until the caller frees it.
  */
+int swap_in_page(u_int32_t slot, paddr_t free_page);
 
-void swap_out_page(struct addrspace *as, vaddr_t vpn, paddr_t page_addr);
+/*
+ * Swap a page from physical memory to disk. Returns the section the
+ * page was written to, with one reference held.
+ */
+u_int32_t swap_out_page(paddr_t page_addr);
+
+/*
+ * Reserve a free section (with one reference held) and write a page
+ * to it later with swap_write_page. Lets the caller publish the section
+ * in page tables before sleeping on the disk.
+ */
+u_int32_t swap_reserve_slot(void);
+int swap_write_page(u_int32_t slot, paddr_t page_addr);
+
+/*
+ * Reserve up to 'npages' adjacent free sections, each with one reference
+ * held. Returns how many were reserved (at least one) and the first of
+ * them in 'first'.
+ */
+int swap_reserve_cluster(int npages, u_int32_t *first);
+
+/*
+ * Move 'npages' pages to or from the adjacent sections starting at
+ * 'first'. page_addrs[i] goes with section first + i. Pages that aren't
+ * in the compressed pool go to or come from the disk, one request for
+ * each run of them. Reading leaves the caller's references alone, as
+ * swap_in_page does. If 'pooled' isn't NULL, pooled[i] says whether
+ * page i came from the compressed pool; a caller that doesn't need the
+ * copy any more should let its section go so the pool room is freed.
+ *
+ * These and swap_in_page/swap_write_page return how many disk requests
+ * they made (0 when every page was in the compressed pool).
+ */
+int swap_write_cluster(u_int32_t first, paddr_t *page_addrs, int npages);
+int swap_read_cluster(u_int32_t first, paddr_t *page_addrs, int npages, int *pooled);
+
+/*
+ * Add/drop a reference to a swap section without any disk I/O
+ */
+void swap_share_slot(u_int32_t slot);
+void swap_free_slot(u_int32_t slot);
 
 void reclaim_all_swap_sections();
 
+/*
+ * Fill in the compressed pool counters (vs_zswap_*) of 'vs'. They are
+ * only kept for the system as a whole.
+ */
+void swap_getstats(struct vmstat *vs);
+
 #if 0 // This function is deprecated
 /*
  * Swap the data from the file point to by 'u' to our swap file
@@ -7,6 +7,7 @@
 
 /* Get machine-dependent stuff */
 #include <machine/pcb.h>
+#include <kern/limits.h>
 
 
 struct addrspace;
@@ -20,6 +21,8 @@ struct thread {
 	char *t_name;
 	const void *t_sleepaddr;
 	char *t_stack;
+	int t_priority;		/* scheduler level, 0 is the highest */
+	int t_ticks;		/* clock ticks left in its quantum */
 	
 	/**********************************************************/
 	/* Public thread members - can be used by other code      */
@@ -76,6 +79,14 @@ struct thread {
 	 * Exit code
 	 */
 	volatile int *exit_code;
+
+	/*
+	 * Open files, indexed by file handle, and the flags they were opened
+	 * with. The console handles (0 to 2) aren't kept here. A forked child
+	 * gets its own reference to each of its parent's files.
+	 */
+	struct vnode *t_files[OPEN_MAX];
+	int t_file_flags[OPEN_MAX];
 };
 
 /* Call once during startup to allocate data structures. */
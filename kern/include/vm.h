@@ -10,7 +10,12 @@
  */
 
 struct addrspace;
+struct vmstat;
 
+/*
+ * Core map entry. The UTLB refill fast path in exception.S knows its size
+ * (32 bytes) and where 'flags' is, so keep them that way.
+ */
 struct page
 {
 	// Page mapping
@@ -24,6 +29,29 @@ struct page
 
 	// Will have bits for dirty, valid, used
 	int32_t flags;
+
+	/*
+	 * Number of page table entries mapping this frame. After a fork
+	 * the parent and child share frames read-only (copy-on-write), so
+	 * this can be more than 1. 'as' is then just one of the sharers.
+	 */
+	int32_t refcount;
+
+	/*
+	 * Swap section still holding an up to date copy of this user page
+	 * (it was swapped in and hasn't been written since), or
+	 * PAGE_NO_SWAP_SLOT. The page holds one reference to the section.
+	 */
+	int32_t swap_slot;
+
+	// Free list links (core map indexes, -1 for none) while this page
+	// heads a free block
+	int32_t next_free;
+	int32_t prev_free;
+
+	// Next frame in the same text page cache bucket (-1 for none) while
+	// PFLAG_CACHED is set
+	int32_t cache_next;
 };
 
 /*
@@ -32,10 +60,11 @@ struct page
 struct page_directory
 {
 	/*
-	 * Upper 20 bits - Page Table - Page number where the page table is stored
+	 * Upper 20 bits - Page Table - Physical frame holding the page table
+	 * (the swap section holding it when it has been swapped to disk)
 	 * 0th bit - PTE_P bit - Page Table present?
 	 * 1st bit - Page directory loaded (if loaded 1 and present 0 it means this page table was
-	 * swapped to disk)
+	 * swapped to disk, which only happens once none of its pages are in memory)
 	 */
 	int32_t pg_dir_entry;
 };
@@ -44,8 +73,12 @@ struct page_table
 {
 
 	/*
-	 * PTE = {20b PFN, 5b0, 1bL, 1bM, 1bR, 1bV, 1bRe, 1bWr, 1bX}
-	 * Upper 20 bits - Page Frame Number
+	 * PTE = {20b PFN, 4b0, 1bC, 1bL, 1bM, 1bR, 1bV, 1bRe, 1bWr, 1bX}
+	 * Upper 20 bits - Page Frame Number. If the page is loaded (L) but not
+	 *                 valid, this is the swap section holding the page.
+	 * C - Copy-on-write. Frame may be shared with other address spaces
+	 *     and must be copied before the first write
+	 * L - Loaded
 	 * M - Modify
 	 * R - Reference bit
 	 * V - Valid
@@ -63,8 +96,22 @@ struct page_table
 
 #define PGTBL_INDEX			0x003ff000
 #define PGTBL_VALID_MASK	0x00000008
+#define PGTBL_MOD_MASK		0x00000020
+#define PGTBL_COW_MASK		0x00000080
+
+/* Swap section of a page (or page table) that has been swapped to disk */
+#define PGTBL_SWAP_SLOT(entry)		(((u_int32_t)(entry)) >> 12)
+#define PGTBL_MK_SWAP_SLOT(slot)	(((u_int32_t)(slot)) << 12)
 
 #define PFLAG_USED_MASK 	0x80000000 // Mask in flag field of a page to indicate if page is in use
+#define PFLAG_FREE_BLOCK	0x40000000 // Page heads a free block. The low bits hold the block's order
+#define PFLAG_REFERENCED	0x20000000 // User page was used since the clock hand last passed it
+#define PFLAG_DIRTY		0x10000000 // User page was written since it was loaded or swapped in
+#define PFLAG_PAGE_TABLE	0x08000000 // Frame holds a page table of 'as'. 'vpn' is the first address it maps
+#define PFLAG_CACHED		0x04000000 // Text page in the page cache, shared by everybody running the executable
+#define PFLAG_FILE_SHARED	0x02000000 // Page of a MAP_SHARED file mapping. Written back to the file, never swapped
+
+#define PAGE_NO_SWAP_SLOT	(-1)
 #define PFLAG_NUM_CONTG_PAGES	0x00000007f // Keeps count of how many contiguous pages from this page was allocated by alloc_kpages
 
 /* Fault-type arguments to vm_fault() */
@@ -72,8 +119,13 @@ struct page_table
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
-/* Maximum User Heap Size */
-#define USER_HEAP_MAX		1048576
+/*
+ * mmap places files between these addresses. The heap (which starts
+ * right after the executable) may not grow past VM_MMAP_BASE and the
+ * stack may not grow below VM_MMAP_TOP.
+ */
+#define VM_MMAP_BASE		0x40000000
+#define VM_MMAP_TOP		0x70000000
 
 /*
  * Return code for vm_fault()
@@ -87,19 +139,44 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/*
- * Function called by sys_waitpid when it needs to sleep.
- * This function will evict all its pages if the coremap
- * is full
- */
-void evict_all_my_pages_if_necessary(struct addrspace *as);
+/* Called by trap code before vm_fault on faults from user mode */
+void vm_ws_wait(void);
+
+/* Start the pageout daemon. Called once swap is up */
+void pageout_bootstrap(void);
 
 // Called by kernel when finished executing user program. This is to prevent
 // any leaks
 void reclaim_all_user_pages();
 
+/*
+ * VM tunables (see the vmtune menu command). vm_set_tunable returns
+ * EINVAL for an unknown name or a value out of range.
+ */
+int vm_set_tunable(const char *name, int value);
+void vm_print_tunables(void);
+
+/* Print VM counters */
+void vm_printstats(void);
+
+/*
+ * Copy the system's VM counters (VMSTAT_SYSTEM) or those of 'as'
+ * (VMSTAT_SELF) to 'vs'. EINVAL for anything else.
+ */
+int vm_getstats(struct addrspace *as, int which, struct vmstat *vs);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate/free kernel pages that need not be physically contiguous
+ * (called by kmalloc/kfree for anything over a page). They are mapped in
+ * kseg2 through the TLB, so they can't hold kernel stacks or anything
+ * the UTLB refill path reads. Before vm_bootstrap they come from
+ * alloc_kpages.
+ */
+vaddr_t alloc_kvpages(int npages);
+void free_kvpages(vaddr_t addr);
+
 #endif /* _VM_H_ */
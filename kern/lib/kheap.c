@@ -70,6 +70,7 @@ struct freelist {
 struct pageref {
 	struct pageref *next_samesize;
 	struct pageref *next_all;
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	u_int16_t freelist_offset;
 	u_int16_t nfree;
@@ -91,7 +92,7 @@ struct pageref {
  * we really ought to be able to have more than one of these pages.
  *
  * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
+ * about 200 pagerefs; this lets us manage about 800k of kernel heap.
  * That would be twice as much memory as we get for *everything*.
  * Thus, we will cheat and not allow any mechanism for having a second
  * page of pageref structs.
@@ -152,6 +153,37 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * kfree finds the pageref of a block through a hash on its page address
+ * rather than by walking allbase.
+ */
+#define NPAGEHASH 64
+#define PAGEHASH(addr) (((addr) / PAGE_SIZE) % NPAGEHASH)
+static struct pageref *pagehash[NPAGEHASH];
+
+/*
+ * A page of each size that had free blocks the last time we looked, so
+ * kmalloc usually doesn't have to walk sizebases[]. It may have filled
+ * up since; check nfree.
+ */
+static struct pageref *sizehints[NSIZES];
+
+/*
+ * Magazines: a small LIFO stack of free blocks for each size. kfree
+ * pushes onto the magazine while it has room and kmalloc pops off it,
+ * so a kmalloc/kfree pair usually never touches a page's free list.
+ * Blocks in a magazine still count as allocated in their page. The big
+ * sizes get small magazines so they don't pin down too much memory.
+ */
+#define MAG_ROUNDS 8
+static const int magsizes[NSIZES] = { 8, 8, 8, 8, 8, 4, 2, 1 };
+static void *magazines[NSIZES][MAG_ROUNDS];
+static int magrounds[NSIZES];
+
+/* How kmallocs were served, for kheap_printstats */
+static u_int32_t mag_hits[NSIZES];
+static u_int32_t mag_misses[NSIZES];
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -289,6 +321,7 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	int i;
 
 	/* print the whole thing with interrupts off */
 	int spl = splhigh();
@@ -299,6 +332,14 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	kprintf("Magazines (blocks shown in use above):\n");
+	for (i=0; i<NSIZES; i++) {
+		kprintf("   size %-4lu  %d/%d full  %lu hits  %lu misses\n",
+			(unsigned long) sizes[i], magrounds[i], magsizes[i],
+			(unsigned long) mag_hits[i],
+			(unsigned long) mag_misses[i]);
+	}
+
 	splx(spl);
 }
 
@@ -327,6 +368,37 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
+
+	for (guy = &pagehash[PAGEHASH(PR_PAGEADDR(pr))]; *guy;
+	     guy = &(*guy)->next_hash) {
+		if (*guy == pr) {
+			*guy = pr->next_hash;
+			break;
+		}
+	}
+
+	if (sizehints[blktype] == pr) {
+		sizehints[blktype] = NULL;
+	}
+}
+
+/*
+ * Find the pageref for the page holding ptraddr. NULL if it isn't one of
+ * our pages.
+ */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t page = ptraddr & PAGE_FRAME;
+
+	for (pr = pagehash[PAGEHASH(page)]; pr != NULL; pr = pr->next_hash) {
+		if (PR_PAGEADDR(pr) == page) {
+			return pr;
+		}
+	}
+	return NULL;
 }
 
 static
@@ -369,41 +441,60 @@ subpage_kmalloc(size_t sz)
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	if (magrounds[blktype] > 0) {
+		retptr = magazines[blktype][--magrounds[blktype]];
+		mag_hits[blktype]++;
+		splx(spl);
+		return retptr;
+	}
+	mag_misses[blktype]++;
 
-		/* check for corruption */
-		assert(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	pr = sizehints[blktype];
+	if (pr == NULL || pr->nfree == 0) {
+		for (pr = sizebases[blktype]; pr != NULL;
+		     pr = pr->next_samesize) {
 
-		if (pr->nfree > 0) {
+			/* check for corruption */
+			assert(PR_BLOCKTYPE(pr) == blktype);
+			checksubpage(pr);
 
-		doalloc: /* comes here after getting a whole fresh page */
+			if (pr->nfree > 0) {
+				break;
+			}
+		}
+	}
 
-			assert(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	if (pr != NULL) {
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	doalloc: /* comes here after getting a whole fresh page */
 
-			if (fl != NULL) {
-				assert(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				assert(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				assert(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		assert(pr->nfree > 0);
+		assert(pr->freelist_offset < PAGE_SIZE);
+		prpage = PR_PAGEADDR(pr);
+		fla = prpage + pr->freelist_offset;
+		fl = (struct freelist *)fla;
 
-			checksubpages();
+		retptr = fl;
+		fl = fl->next;
+		pr->nfree--;
 
-			splx(spl);
-			return retptr;
+		if (fl != NULL) {
+			assert(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			assert(fla - prpage < PAGE_SIZE);
+			pr->freelist_offset = fla - prpage;
 		}
+		else {
+			assert(pr->nfree == 0);
+			pr->freelist_offset = INVALID_OFFSET;
+		}
+
+		sizehints[blktype] = pr;
+
+		checksubpages();
+
+		splx(spl);
+		return retptr;
 	}
 
 	/*
@@ -455,11 +546,57 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pr->next_hash = pagehash[PAGEHASH(prpage)];
+	pagehash[PAGEHASH(prpage)] = pr;
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 	return NULL; // never comes here
 }
 
+/*
+ * Put a block back on the free list of its page, and give the page back
+ * if that was its last block in use. Must be at splhigh.
+ */
+static
+void
+subpage_putblock(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	assert(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		free_kpages(prpage);
+		freepageref(pr);
+	}
+	else {
+		sizehints[blktype] = pr;
+	}
+}
+
 static
 int
 subpage_kfree(void *ptr)
@@ -468,9 +605,6 @@ subpage_kfree(void *ptr)
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
@@ -479,26 +613,20 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		assert(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		splx(spl);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	assert(blktype>=0 && blktype<NSIZES);
+	checksubpage(pr);
+
+	offset = ptraddr - PR_PAGEADDR(pr);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
@@ -511,27 +639,11 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (magrounds[blktype] < magsizes[blktype]) {
+		magazines[blktype][magrounds[blktype]++] = ptr;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	assert(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		free_kpages(prpage);
-		freepageref(pr);
+	else {
+		subpage_putblock(pr, offset);
 	}
 
 	checksubpages();
@@ -540,19 +652,344 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+/*
+ * Empty the magazines back into their pages, so the pages that are
+ * completely free can be given back.
+ */
+void
+kheap_drain(void)
+{
+	int spl;
+	int i;
+	vaddr_t ptraddr;
+	struct pageref *pr;
+
+	spl = splhigh();
+
+	for (i=0; i<NSIZES; i++) {
+		while (magrounds[i] > 0) {
+			ptraddr = (vaddr_t)magazines[i][--magrounds[i]];
+			pr = findpageref(ptraddr);
+			assert(pr != NULL);
+			subpage_putblock(pr, ptraddr - PR_PAGEADDR(pr));
+		}
+	}
+
+	checksubpages();
+
+	splx(spl);
+}
+
+//
+////////////////////////////////////////////////////////////
+//
+// Allocation profiling.
+//
+// While profiling is on, kmalloc records who called it. Each call site
+// and size class gets a slot in kprof_sites[] with its counters, and each
+// block still allocated gets an entry in kprof_live[], an open addressed
+// hash on the block address, so that kfree can charge the site the block
+// came from. Blocks are tagged with the generation they were allocated
+// in; kheap_profile_mark starts a new one, so kheap_profile_leaks can
+// tell what a user program left behind.
+//
+// Blocks allocated while profiling was off, or while either table was
+// full, aren't tracked and kfree leaves the counters alone for them.
+// kmalloc's caller is charged, so everything kstrdup allocates shows up
+// under kstrdup. The object caches hand out memory kmalloc doesn't see;
+// they charge each object to slab_alloc's caller through
+// kheap_profile_alloc and kheap_profile_free.
+//
+
+#define KPROF_SITES 64
+#define KPROF_LIVE  512
+#define KPROF_TOP   16
+
+#define KPROF_HASH(addr) ((((addr) >> 3) ^ ((addr) >> 12)) % KPROF_LIVE)
+
+struct kprof_site {
+	vaddr_t ks_caller;
+	size_t ks_size;		/* size class */
+	u_int32_t ks_allocs;
+	u_int32_t ks_frees;
+	u_int32_t ks_live;
+	u_int32_t ks_live_bytes;
+};
+
+struct kprof_block {
+	vaddr_t kb_addr;	/* 0 for an empty slot */
+	u_int16_t kb_site;
+	u_int16_t kb_gen;
+};
+
+static int kprof_on;
+static u_int16_t kprof_gen;
+static struct kprof_site kprof_sites[KPROF_SITES];
+static int kprof_nsites;
+static struct kprof_block kprof_live[KPROF_LIVE];
+static int kprof_nlive;
+static u_int32_t kprof_untracked;
+
+static
+size_t
+sizeclass(size_t sz)
+{
+	if (sz >= LARGEST_SUBPAGE_SIZE) {
+		return (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	}
+	return sizes[blocktype(sz)];
+}
+
+static
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	struct kprof_site *ks;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+
+	for (i=0; i<(unsigned)kprof_nsites; i++) {
+		ks = &kprof_sites[i];
+		if (ks->ks_caller == caller && ks->ks_size == sz) {
+			break;
+		}
+	}
+	if (i == (unsigned)kprof_nsites) {
+		if (kprof_nsites == KPROF_SITES) {
+			kprof_untracked++;
+			splx(spl);
+			return;
+		}
+		ks = &kprof_sites[kprof_nsites++];
+		bzero(ks, sizeof(*ks));
+		ks->ks_caller = caller;
+		ks->ks_size = sz;
+	}
+	ks->ks_allocs++;
+
+	/* Keep the hash no more than 3/4 full */
+	if (kprof_nlive >= KPROF_LIVE * 3 / 4) {
+		kprof_untracked++;
+		splx(spl);
+		return;
+	}
+	ks->ks_live++;
+	ks->ks_live_bytes += sz;
+
+	i = KPROF_HASH((vaddr_t)ptr);
+	while (kprof_live[i].kb_addr != 0) {
+		i = (i + 1) % KPROF_LIVE;
+	}
+	kprof_live[i].kb_addr = (vaddr_t)ptr;
+	kprof_live[i].kb_site = ks - kprof_sites;
+	kprof_live[i].kb_gen = kprof_gen;
+	kprof_nlive++;
+
+	splx(spl);
+}
+
+/*
+ * Remove entry i from the live block hash, moving later entries of the
+ * same probe sequence back so lookups don't stop short.
+ */
+static
+void
+kprof_remove(unsigned i)
+{
+	unsigned j = i, k;
+
+	for (;;) {
+		kprof_live[i].kb_addr = 0;
+		do {
+			j = (j + 1) % KPROF_LIVE;
+			if (kprof_live[j].kb_addr == 0) {
+				return;
+			}
+			k = KPROF_HASH(kprof_live[j].kb_addr);
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		kprof_live[i] = kprof_live[j];
+		i = j;
+	}
+}
+
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_site *ks;
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+
+	for (i = KPROF_HASH((vaddr_t)ptr); kprof_live[i].kb_addr != 0;
+	     i = (i + 1) % KPROF_LIVE) {
+		if (kprof_live[i].kb_addr == (vaddr_t)ptr) {
+			ks = &kprof_sites[kprof_live[i].kb_site];
+			ks->ks_frees++;
+			ks->ks_live--;
+			ks->ks_live_bytes -= ks->ks_size;
+			kprof_remove(i);
+			kprof_nlive--;
+			break;
+		}
+	}
+
+	splx(spl);
+}
+
+void
+kheap_profile_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	if (kprof_on) {
+		kprof_alloc(ptr, sz, caller);
+	}
+}
+
+void
+kheap_profile_free(void *ptr)
+{
+	if (kprof_nlive > 0) {
+		kprof_free(ptr);
+	}
+}
+
+void
+kheap_profile(int on)
+{
+	kprof_on = on;
+}
+
+void
+kheap_profile_reset(void)
+{
+	int spl = splhigh();
+
+	kprof_nsites = 0;
+	kprof_nlive = 0;
+	kprof_untracked = 0;
+	bzero(kprof_live, sizeof(kprof_live));
+
+	splx(spl);
+}
+
+void
+kheap_profile_print(void)
+{
+	u_int8_t order[KPROF_SITES];
+	struct kprof_site *ks;
+	int i, j, best, n;
+	u_int8_t tmp;
+
+	/* print the whole thing with interrupts off */
+	int spl = splhigh();
+
+	kprintf("Kernel heap profile (%s): %d sites, %d blocks live, "
+		"%lu allocations untracked\n", kprof_on ? "on" : "off",
+		kprof_nsites, kprof_nlive, (unsigned long) kprof_untracked);
+
+	/* Busiest sites first */
+	for (i=0; i<kprof_nsites; i++) {
+		order[i] = i;
+	}
+	n = kprof_nsites < KPROF_TOP ? kprof_nsites : KPROF_TOP;
+	for (i=0; i<n; i++) {
+		best = i;
+		for (j=i+1; j<kprof_nsites; j++) {
+			if (kprof_sites[order[j]].ks_allocs >
+			    kprof_sites[order[best]].ks_allocs) {
+				best = j;
+			}
+		}
+		tmp = order[i];
+		order[i] = order[best];
+		order[best] = tmp;
+	}
+
+	kprintf("   caller      size    allocs     frees   live  live bytes\n");
+	for (i=0; i<n; i++) {
+		ks = &kprof_sites[order[i]];
+		kprintf("   0x%08lx %6lu %9lu %9lu %6lu %11lu\n",
+			(unsigned long) ks->ks_caller,
+			(unsigned long) ks->ks_size,
+			(unsigned long) ks->ks_allocs,
+			(unsigned long) ks->ks_frees,
+			(unsigned long) ks->ks_live,
+			(unsigned long) ks->ks_live_bytes);
+	}
+
+	splx(spl);
+}
+
+void
+kheap_profile_mark(void)
+{
+	int spl = splhigh();
+	kprof_gen++;
+	splx(spl);
+}
+
+void
+kheap_profile_leaks(void)
+{
+	struct kprof_site *ks;
+	int i, n = 0;
+	u_int32_t bytes = 0;
+
+	if (!kprof_on) {
+		return;
+	}
+
+	/* print the whole thing with interrupts off */
+	int spl = splhigh();
+
+	for (i=0; i<KPROF_LIVE; i++) {
+		if (kprof_live[i].kb_addr == 0 ||
+		    kprof_live[i].kb_gen != kprof_gen) {
+			continue;
+		}
+		ks = &kprof_sites[kprof_live[i].kb_site];
+		if (n++ == 0) {
+			kprintf("Still allocated since the program started:\n");
+		}
+		kprintf("   0x%08lx (%lu bytes) from 0x%08lx\n",
+			(unsigned long) kprof_live[i].kb_addr,
+			(unsigned long) ks->ks_size,
+			(unsigned long) ks->ks_caller);
+		bytes += ks->ks_size;
+	}
+	if (n > 0) {
+		kprintf("%d blocks, %lu bytes\n", n, (unsigned long) bytes);
+	}
+
+	splx(spl);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 void *
-kmalloc(size_t sz)
+kmalloc_noprof(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+		/*
+		 * Round up to a whole number of pages. More than one page
+		 * goes to kseg2 and doesn't need a contiguous run. A single
+		 * page stays in kseg0: kernel stacks and page directories
+		 * are allocated this way and must not take TLB misses.
+		 */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+		if (npages > 1) {
+			address = alloc_kvpages(npages);
+		}
+		else {
+			address = alloc_kpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
@@ -563,17 +1000,40 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	void *ptr = kmalloc_noprof(sz);
+
+	if (kprof_on && ptr != NULL) {
+		kprof_alloc(ptr, sizeclass(sz),
+			    (vaddr_t)__builtin_return_address(0));
+	}
+	return ptr;
+}
+
 void
 kfree(void *ptr)
 {
+	if (ptr == NULL) {
+		return;
+	}
+
+	/* Even with profiling off, blocks tracked earlier are let go of */
+	if (kprof_nlive > 0) {
+		kprof_free(ptr);
+	}
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
+	if (subpage_kfree(ptr)) {
 		assert((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+		if ((vaddr_t)ptr >= MIPS_KSEG2) {
+			free_kvpages((vaddr_t)ptr);
+		}
+		else {
+			free_kpages((vaddr_t)ptr);
+		}
 	}
 }
-
@@ -9,10 +9,17 @@
 #include <lib.h>
 #include <kern/errno.h>
 #include <list.h>
+#include <slab.h>
+
+/* Lists and their items are allocated from object caches */
+static struct slab_cache list_cache =
+	SLAB_CACHE_INITIALIZER("list", sizeof(struct list), NULL, NULL);
+static struct slab_cache list_item_cache =
+	SLAB_CACHE_INITIALIZER("list_item", sizeof(struct list_item), NULL, NULL);
 
 void *list_create()
 {
-	struct list *l = kmalloc(sizeof(struct list));
+	struct list *l = slab_alloc(&list_cache);
 
 	if(l == NULL)
 		return NULL;
@@ -28,7 +35,7 @@ int list_insert(struct list *l, int key, void *value)
 	// Empty list
 	if(l->head == NULL)
 	{
-		l->head = kmalloc(sizeof(struct list_item));
+		l->head = slab_alloc(&list_item_cache);
 		if(l->head == NULL)
 			return ENOMEM;
 		l->head->key = key;
@@ -40,7 +47,7 @@ int list_insert(struct list *l, int key, void *value)
 	// for duplicates
 	else
 	{
-		struct list_item *new_item = kmalloc(sizeof(struct list_item));
+		struct list_item *new_item = slab_alloc(&list_item_cache);
 		if(new_item == NULL)
 			return ENOMEM;
 		new_item->key = key;
@@ -78,12 +85,12 @@ void list_remove_helper(struct list *l, struct list_item *li,
 	{
 		prev = l->head;
 		l->head = l->head->next;
-		kfree(prev);
+		slab_free(&list_item_cache, prev);
 	}
 	else
 	{
 		prev->next = li->next;
-		kfree(li);
+		slab_free(&list_item_cache, li);
 	}
 }
 
@@ -124,10 +131,10 @@ void list_destroy(struct list **l, void (*item_destroy)(void*))
 		item_destroy(li->value);
 		temp = li;
 		li = li->next;
-		kfree(temp);
+		slab_free(&list_item_cache, temp);
 	}
 
-	kfree(*l);
+	slab_free(&list_cache, *l);
 	*l = NULL;
 	return;
 }
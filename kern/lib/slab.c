@@ -0,0 +1,353 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <slab.h>
+#include <machine/spl.h>
+
+/*
+ * Object caches (see slab.h).
+ *
+ * A slab is one page. It starts with a struct slab and the objects
+ * follow, each with a word after it that links it into the slab's free
+ * list while it is free. Keeping the link outside the object leaves the
+ * constructed object alone. The slab a free object belongs to is found
+ * by rounding its address down to the page.
+ *
+ * Slabs with free objects are kept on the cache's partial list, full
+ * ones on its full list (both doubly linked, so a slab can be moved in
+ * constant time).
+ */
+
+struct slab {
+	struct slab_cache *sl_cache;
+	struct slab *sl_next;
+	struct slab *sl_prev;
+	void *sl_free;		/* first free object */
+	int sl_inuse;
+};
+
+#define SLAB_HEADER	((sizeof(struct slab) + 7) & ~7)
+#define SLAB_LINK(sc, obj)	((void **)((char *)(obj) + (sc)->sc_link))
+
+/* Every cache that was set up, for slab_reap and slab_printstats */
+static struct slab_cache *allcaches;
+
+static
+void
+slab_setup(struct slab_cache *sc)
+{
+	assert(sc->sc_size > 0);
+
+	if (sc->sc_size <= SLAB_MAX_SIZE) {
+		sc->sc_link = (sc->sc_size + 3) & ~3;
+		sc->sc_stride = (sc->sc_link + sizeof(void *) + 7) & ~7;
+		sc->sc_perslab = (PAGE_SIZE - SLAB_HEADER) / sc->sc_stride;
+	}
+	else {
+		/* Big objects don't go in slabs */
+		sc->sc_perslab = 1;
+	}
+
+	sc->sc_next = allcaches;
+	allcaches = sc;
+}
+
+static
+void
+slab_unlink(struct slab **list, struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		assert(*list == sl);
+		*list = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+}
+
+static
+void
+slab_link(struct slab **list, struct slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list != NULL) {
+		(*list)->sl_prev = sl;
+	}
+	*list = sl;
+}
+
+/*
+ * Run the destructor on the objects of a slab that is being given back
+ * (the first 'nobjs' of them, if its setup failed half way) and free
+ * its page.
+ */
+static
+void
+slab_destroy(struct slab_cache *sc, struct slab *sl, int nobjs)
+{
+	int i;
+
+	if (sc->sc_dtor != NULL) {
+		for (i=0; i<nobjs; i++) {
+			sc->sc_dtor((char *)sl + SLAB_HEADER + i*sc->sc_stride);
+		}
+	}
+	free_kpages((vaddr_t)sl);
+}
+
+/*
+ * Give an empty slab back. It must be on the partial list.
+ */
+static
+void
+slab_release(struct slab_cache *sc, struct slab *sl)
+{
+	assert(sl->sl_inuse == 0);
+
+	slab_unlink(&sc->sc_partial, sl);
+	sc->sc_slabs--;
+	slab_destroy(sc, sl, sc->sc_perslab);
+}
+
+/*
+ * Add a new slab to the partial list. alloc_kpages may sleep; nothing
+ * in the cache is held across it.
+ */
+static
+int
+slab_grow(struct slab_cache *sc)
+{
+	struct slab *sl;
+	char *obj;
+	int i, result;
+
+	sl = (struct slab *)alloc_kpages(1);
+	if (sl == NULL) {
+		return ENOMEM;
+	}
+
+	sl->sl_cache = sc;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+
+	/* Construct the objects and push them so the first is on top */
+	for (i=sc->sc_perslab-1; i>=0; i--) {
+		obj = (char *)sl + SLAB_HEADER + i*sc->sc_stride;
+		if (sc->sc_ctor != NULL) {
+			result = sc->sc_ctor(obj);
+			if (result) {
+				/* Destroy the ones that were constructed */
+				while (sl->sl_free != NULL) {
+					obj = sl->sl_free;
+					sl->sl_free = *SLAB_LINK(sc, obj);
+					if (sc->sc_dtor != NULL) {
+						sc->sc_dtor(obj);
+					}
+				}
+				slab_destroy(sc, sl, 0);
+				return result;
+			}
+		}
+		*SLAB_LINK(sc, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+
+	slab_link(&sc->sc_partial, sl);
+	sc->sc_nempty++;
+	sc->sc_slabs++;
+	sc->sc_grows++;
+	return 0;
+}
+
+static
+void *
+slab_alloc_big(struct slab_cache *sc)
+{
+	void *obj;
+
+	if (sc->sc_nbig > 0) {
+		return sc->sc_big[--sc->sc_nbig];
+	}
+
+	obj = kmalloc_noprof(sc->sc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (sc->sc_ctor != NULL && sc->sc_ctor(obj)) {
+		kfree(obj);
+		return NULL;
+	}
+	sc->sc_slabs++;
+	sc->sc_grows++;
+	return obj;
+}
+
+static
+void
+slab_free_big(struct slab_cache *sc, void *obj)
+{
+	if (sc->sc_nbig < SLAB_KEEP_BIG) {
+		sc->sc_big[sc->sc_nbig++] = obj;
+		return;
+	}
+
+	if (sc->sc_dtor != NULL) {
+		sc->sc_dtor(obj);
+	}
+	kfree(obj);
+	sc->sc_slabs--;
+}
+
+void *
+slab_alloc(struct slab_cache *sc)
+{
+	struct slab *sl;
+	void *obj;
+	int spl;
+
+	spl = splhigh();
+
+	if (sc->sc_perslab == 0) {
+		slab_setup(sc);
+	}
+
+	if (sc->sc_size > SLAB_MAX_SIZE) {
+		obj = slab_alloc_big(sc);
+		if (obj != NULL) {
+			sc->sc_allocs++;
+			sc->sc_inuse++;
+			kheap_profile_alloc(obj, sc->sc_size,
+				(vaddr_t)__builtin_return_address(0));
+		}
+		splx(spl);
+		return obj;
+	}
+
+	if (sc->sc_partial == NULL && slab_grow(sc)) {
+		splx(spl);
+		return NULL;
+	}
+
+	sl = sc->sc_partial;
+	obj = sl->sl_free;
+	assert(obj != NULL);
+	sl->sl_free = *SLAB_LINK(sc, obj);
+	if (sl->sl_inuse++ == 0) {
+		sc->sc_nempty--;
+	}
+	if (sl->sl_free == NULL) {
+		slab_unlink(&sc->sc_partial, sl);
+		slab_link(&sc->sc_full, sl);
+	}
+
+	sc->sc_allocs++;
+	sc->sc_inuse++;
+	kheap_profile_alloc(obj, sc->sc_size,
+			    (vaddr_t)__builtin_return_address(0));
+
+	splx(spl);
+	return obj;
+}
+
+void
+slab_free(struct slab_cache *sc, void *obj)
+{
+	struct slab *sl;
+	int spl;
+
+	assert(obj != NULL);
+
+	spl = splhigh();
+
+	assert(sc->sc_inuse > 0);
+	sc->sc_inuse--;
+	kheap_profile_free(obj);
+
+	if (sc->sc_size > SLAB_MAX_SIZE) {
+		slab_free_big(sc, obj);
+		splx(spl);
+		return;
+	}
+
+	sl = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	assert(sl->sl_cache == sc);
+	assert(sl->sl_inuse > 0);
+
+	if (sl->sl_free == NULL) {
+		slab_unlink(&sc->sc_full, sl);
+		slab_link(&sc->sc_partial, sl);
+	}
+	*SLAB_LINK(sc, obj) = sl->sl_free;
+	sl->sl_free = obj;
+
+	if (--sl->sl_inuse == 0) {
+		/* Keep one empty slab for the next allocation */
+		if (sc->sc_nempty > 0) {
+			slab_release(sc, sl);
+		}
+		else {
+			sc->sc_nempty++;
+		}
+	}
+
+	splx(spl);
+}
+
+void
+slab_reap(void)
+{
+	struct slab_cache *sc;
+	struct slab *sl, *next;
+	void *obj;
+	int spl;
+
+	spl = splhigh();
+
+	for (sc = allcaches; sc != NULL; sc = sc->sc_next) {
+		while (sc->sc_nbig > 0) {
+			obj = sc->sc_big[--sc->sc_nbig];
+			if (sc->sc_dtor != NULL) {
+				sc->sc_dtor(obj);
+			}
+			kfree(obj);
+			sc->sc_slabs--;
+		}
+
+		for (sl = sc->sc_partial; sl != NULL && sc->sc_nempty > 0;
+		     sl = next) {
+			next = sl->sl_next;
+			if (sl->sl_inuse == 0) {
+				slab_release(sc, sl);
+				sc->sc_nempty--;
+			}
+		}
+	}
+
+	splx(spl);
+}
+
+void
+slab_printstats(void)
+{
+	struct slab_cache *sc;
+
+	/* print the whole thing with interrupts off */
+	int spl = splhigh();
+
+	kprintf("Object caches:\n");
+	kprintf("%-12s %6s %6s %6s %6s %8s\n", "name", "size", "inuse",
+		"slabs", "grows", "allocs");
+	for (sc = allcaches; sc != NULL; sc = sc->sc_next) {
+		kprintf("%-12s %6u %6u %6u %6u %8u%s\n", sc->sc_name,
+			sc->sc_size, sc->sc_inuse, sc->sc_slabs, sc->sc_grows,
+			sc->sc_allocs,
+			sc->sc_size > SLAB_MAX_SIZE ? " (big)" : "");
+	}
+
+	splx(spl);
+}
@@ -86,6 +86,7 @@ boot(void)
 	pid_bootstrap();
 	vm_bootstrap();
 	swap_bootstrap();
+	pageout_bootstrap();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -19,6 +19,7 @@
 #include <pid.h>
 #include <vm.h>
 #include <swap.h>
+#include <slab.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -113,6 +114,7 @@ common_prog(int nargs, char **args)
 		kprintf("No more pid available! Can't start user process :'(\n");
 		return EAGAIN;
 	}
+	kheap_profile_mark();
 	int spl = splhigh();
 	result = thread_fork(args[0] /* thread name */,
 			args /* thread arg */, nargs /* thread arg */,
@@ -131,6 +133,11 @@ common_prog(int nargs, char **args)
 	reclaim_all_swap_sections();
 	splx(spl);
 
+	// With heap profiling on, report what the program left allocated. Its
+	// thread may not have been reaped yet, so its name (from kstrdup) can
+	// show up too
+	kheap_profile_leaks();
+
 	return 0;
 }
 
@@ -429,6 +436,37 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for looking at and changing VM tunables.
+ */
+static
+int
+cmd_vmtune(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_print_tunables();
+		return 0;
+	}
+	if (nargs != 3) {
+		kprintf("Usage: vmtune [name value]\n");
+		return EINVAL;
+	}
+
+	return vm_set_tunable(args[1], atoi(args[2]));
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -437,10 +475,36 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	slab_printstats();
 	
 	return 0;
 }
 
+static
+int
+cmd_khprof(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kheap_profile_print();
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		kheap_profile(1);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		kheap_profile(0);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_profile_reset();
+		return 0;
+	}
+
+	kprintf("Usage: khprof [on|off|reset]\n");
+	return EINVAL;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -501,6 +565,7 @@ static const char *opsmenu[] = {
 	"[s]       Shell                     ",
 	"[p]       Other program             ",
 	"[dbflags] Debug flags               ",
+	"[vmtune]  VM tunables               ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[bootfs]  Set \"boot\" filesystem     ",
@@ -572,7 +637,9 @@ static const char *mainmenu[] = {
 	"[1b] Cat/mouse with locks and CVs   ",
 	"[1c] Stoplight                      ",
 #endif
-	"[kh] Kernel heap stats              ",
+	"[kh] Kernel heap and cache stats    ",
+	"[khprof] Kernel heap profile        ",
+	"[vmstat] VM stats                   ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -608,6 +675,7 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "dbflags", cmd_dbflags },
 	{ "df", cmd_df },
+	{ "vmtune",	cmd_vmtune },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "bootfs",	cmd_bootfs },
@@ -629,6 +697,8 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "khprof",	cmd_khprof },
+	{ "vmstat",	cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
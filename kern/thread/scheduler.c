@@ -1,14 +1,33 @@
 /*
  * Scheduler.
  *
- * The default scheduler is very simple, just a round-robin run queue.
- * You'll want to improve it.
+ * Multi-level feedback queue. There is a run queue for each priority
+ * level and the scheduler always runs the first thread of the highest
+ * level that has one. Each level has its own quantum (in hardclock
+ * ticks), longer at the lower levels:
+ *
+ *   - a thread that uses up its quantum drops a level, so CPU-bound
+ *     threads sink;
+ *   - a thread that was asleep (waiting for I/O, a lock, a child...)
+ *     comes back at the top level with a fresh quantum, so interactive
+ *     threads like the console reader and the shell get the CPU as soon
+ *     as they have something to do;
+ *   - a thread that yields or is preempted before its quantum is up
+ *     keeps its level and what is left of its quantum;
+ *   - once a second every runnable thread is moved back to the top
+ *     level, so the ones at the bottom can't be starved.
+ *
+ * hardclock calls scheduler_tick, which says when the running thread has
+ * to give up the CPU: its quantum is over, or a thread at a higher level
+ * became runnable.
  */
 
 #include <types.h>
 #include <lib.h>
 #include <scheduler.h>
 #include <thread.h>
+#include <curthread.h>
+#include <clock.h>
 #include <machine/spl.h>
 #include <queue.h>
 
@@ -16,8 +35,17 @@
  *  Scheduler data
  */
 
-// Queue of runnable threads
-static struct queue *runqueue;
+#define SCHED_LEVELS		4
+#define SCHED_BOOST_TICKS	HZ
+
+// Quantum of each level, in hardclock ticks
+static const int sched_quantum[SCHED_LEVELS] = { 1, 2, 4, 8 };
+
+// Queues of runnable threads, one per level. Level 0 runs first
+static struct queue *runqueues[SCHED_LEVELS];
+
+// Ticks since the last boost
+static int boost_counter;
 
 /*
  * Setup function
@@ -25,24 +53,36 @@ static struct queue *runqueue;
 void
 scheduler_bootstrap(void)
 {
-	runqueue = q_create(32);
-	if (runqueue == NULL) {
-		panic("scheduler: Could not create run queue\n");
+	int i;
+
+	for (i=0; i<SCHED_LEVELS; i++) {
+		runqueues[i] = q_create(32);
+		if (runqueues[i] == NULL) {
+			panic("scheduler: Could not create run queue\n");
+		}
 	}
 }
 
 /*
  * Ensure space for handling at least NTHREADS threads.
  * This is done only to ensure that make_runnable() does not fail -
- * if you change the scheduler to not require space outside the 
+ * if you change the scheduler to not require space outside the
  * thread structure, for instance, this function can reasonably
- * do nothing.
+ * do nothing. Every thread can end up on any level.
  */
 int
 scheduler_preallocate(int nthreads)
 {
+	int i, result;
+
 	assert(curspl>0);
-	return q_preallocate(runqueue, nthreads);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		result = q_preallocate(runqueues[i], nthreads);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
 }
 
 /*
@@ -54,10 +94,14 @@ scheduler_preallocate(int nthreads)
 void
 scheduler_killall(void)
 {
+	int i;
+
 	assert(curspl>0);
-	while (!q_empty(runqueue)) {
-		struct thread *t = q_remhead(runqueue);
-		kprintf("scheduler: Dropping thread %s.\n", t->t_name);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		while (!q_empty(runqueues[i])) {
+			struct thread *t = q_remhead(runqueues[i]);
+			kprintf("scheduler: Dropping thread %s.\n", t->t_name);
+		}
 	}
 }
 
@@ -71,54 +115,149 @@ scheduler_killall(void)
 void
 scheduler_shutdown(void)
 {
+	int i;
+
 	scheduler_killall();
 
 	assert(curspl>0);
-	q_destroy(runqueue);
-	runqueue = NULL;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		q_destroy(runqueues[i]);
+		runqueues[i] = NULL;
+	}
 }
 
 /*
  * Actual scheduler. Returns the next thread to run.  Calls cpu_idle()
  * if there's nothing ready. (Note: cpu_idle must be called in a loop
  * until something's ready - it doesn't know whether the things that
- * wake it up are going to make a thread runnable or not.) 
+ * wake it up are going to make a thread runnable or not.)
  */
 struct thread *
 scheduler(void)
 {
+	int i;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
-	
-	while (q_empty(runqueue)) {
+
+	for (;;) {
+		for (i=0; i<SCHED_LEVELS; i++) {
+			if (!q_empty(runqueues[i])) {
+				// You can actually uncomment this to see what
+				// the scheduler's doing - even this deep inside
+				// thread code, the console still works. However,
+				// the amount of text printed is prohibitive.
+				//
+				//print_run_queue();
+
+				return q_remhead(runqueues[i]);
+			}
+		}
 		cpu_idle();
 	}
-
-	// You can actually uncomment this to see what the scheduler's
-	// doing - even this deep inside thread code, the console
-	// still works. However, the amount of text printed is
-	// prohibitive.
-	// 
-	//print_run_queue();
-	
-	return q_remhead(runqueue);
 }
 
-/* 
+/*
  * Make a thread runnable.
- * With the base scheduler, just add it to the end of the run queue.
+ * It goes to the end of the queue of its level. A thread whose quantum
+ * was used up gets a new one.
  */
 int
 make_runnable(struct thread *t)
 {
 	// meant to be called with interrupts off
 	assert(curspl>0);
+	assert(t->t_priority >= 0 && t->t_priority < SCHED_LEVELS);
 
-	return q_addtail(runqueue, t);
+	if (t->t_ticks <= 0) {
+		t->t_ticks = sched_quantum[t->t_priority];
+	}
+	return q_addtail(runqueues[t->t_priority], t);
 }
 
 /*
- * Debugging function to dump the run queue.
+ * Make a thread that was asleep runnable, at the top level with a fresh
+ * quantum.
+ */
+int
+make_runnable_woken(struct thread *t)
+{
+	t->t_priority = 0;
+	t->t_ticks = 0;
+	return make_runnable(t);
+}
+
+/*
+ * Move every runnable thread, and the one running, back to the top level.
+ * What is left of their quanta is cut down to the top level's.
+ */
+static
+void
+scheduler_boost(void)
+{
+	struct thread *t;
+	int i, result;
+
+	for (i=1; i<SCHED_LEVELS; i++) {
+		while (!q_empty(runqueues[i])) {
+			t = q_remhead(runqueues[i]);
+			t->t_priority = 0;
+			if (t->t_ticks > sched_quantum[0]) {
+				t->t_ticks = sched_quantum[0];
+			}
+			/* Space was preallocated for every thread on every level */
+			result = q_addtail(runqueues[0], t);
+			assert(result==0);
+		}
+	}
+	if (curthread != NULL) {
+		curthread->t_priority = 0;
+		if (curthread->t_ticks > sched_quantum[0]) {
+			curthread->t_ticks = sched_quantum[0];
+		}
+	}
+}
+
+/*
+ * Called by hardclock on every tick. Returns nonzero if the running
+ * thread should yield: its quantum is up (it drops a level) or a thread
+ * at a higher level is waiting.
+ */
+int
+scheduler_tick(void)
+{
+	int i;
+
+	assert(curspl>0);
+
+	if (++boost_counter >= SCHED_BOOST_TICKS) {
+		boost_counter = 0;
+		scheduler_boost();
+	}
+
+	/* Idle loop, the scheduler is running */
+	if (curthread == NULL) {
+		return 0;
+	}
+
+	if (--curthread->t_ticks <= 0) {
+		if (curthread->t_priority < SCHED_LEVELS-1) {
+			curthread->t_priority++;
+		}
+		curthread->t_ticks = 0;
+		return 1;
+	}
+
+	for (i=0; i<curthread->t_priority; i++) {
+		if (!q_empty(runqueues[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Debugging function to dump the run queues.
  */
 void
 print_run_queue(void)
@@ -126,15 +265,29 @@ print_run_queue(void)
 	/* Turn interrupts off so the whole list prints atomically. */
 	int spl = splhigh();
 
-	int i,k=0;
-	i = q_getstart(runqueue);
-	
-	while (i!=q_getend(runqueue)) {
-		struct thread *t = q_getguy(runqueue, i);
-		kprintf("  %2d: %s %p\n", k, t->t_name, t->t_sleepaddr);
-		i=(i+1)%q_getsize(runqueue);
-		k++;
+	int i,k,level;
+
+	if (curthread != NULL) {
+		kprintf("  running: %s, level %d, %d of %d ticks left\n",
+			curthread->t_name, curthread->t_priority,
+			curthread->t_ticks,
+			sched_quantum[curthread->t_priority]);
+	}
+
+	for (level=0; level<SCHED_LEVELS; level++) {
+		kprintf("  level %d (quantum %d ticks):\n", level,
+			sched_quantum[level]);
+
+		k = 0;
+		i = q_getstart(runqueues[level]);
+		while (i!=q_getend(runqueues[level])) {
+			struct thread *t = q_getguy(runqueues[level], i);
+			kprintf("  %2d: %s %p, %d ticks left\n", k, t->t_name,
+				t->t_sleepaddr, t->t_ticks);
+			i=(i+1)%q_getsize(runqueues[level]);
+			k++;
+		}
 	}
-	
+
 	splx(spl);
 }
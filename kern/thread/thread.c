@@ -12,8 +12,10 @@
 #include <scheduler.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <vfs.h>
 #include <synch.h>
 #include <pid.h>
+#include <slab.h>
 #include "opt-synchprobs.h"
 
 /* States a thread can be in. */
@@ -42,6 +44,31 @@ static struct array *zombies;
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
+/*
+ * Thread structures and their stacks are recycled through object caches.
+ * A cached stack keeps the magic number its constructor put on it.
+ */
+static int stack_ctor(void *stack);
+
+static struct slab_cache thread_cache =
+	SLAB_CACHE_INITIALIZER("thread", sizeof(struct thread), NULL, NULL);
+static struct slab_cache stack_cache =
+	SLAB_CACHE_INITIALIZER("kstack", STACK_SIZE, stack_ctor, NULL);
+
+static
+int
+stack_ctor(void *stack)
+{
+	char *s = stack;
+
+	/* stick a magic number on the bottom end of the stack */
+	s[0] = 0xae;
+	s[1] = 0x11;
+	s[2] = 0xda;
+	s[3] = 0x33;
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create the first thread's 
  * thread structure and to create subsequent threads.
@@ -50,18 +77,20 @@ static int numthreads;
 struct thread *
 thread_create(const char *name)
 {
-	struct thread *thread = kmalloc(sizeof(struct thread));
+	struct thread *thread = slab_alloc(&thread_cache);
 	if (thread==NULL) {
 		return NULL;
 	}
 	thread->t_name = kstrdup(name);
 	if (thread->t_name==NULL) {
-		kfree(thread);
+		slab_free(&thread_cache, thread);
 		return NULL;
 	}
 
 	thread->t_sleepaddr = NULL;
 	thread->t_stack = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 	
 	thread->t_vmspace = NULL;
 
@@ -78,6 +107,12 @@ thread_create(const char *name)
 	thread->has_exited = NULL;
 	thread->exit_code = NULL;
 
+	int i;
+	for(i = 0; i < OPEN_MAX; ++i)
+	{
+		thread->t_files[i] = NULL;
+	}
+
 	return thread;
 }
 
@@ -101,11 +136,11 @@ thread_destroy(struct thread *thread)
 	assert(thread->children == NULL);
 	
 	if (thread->t_stack) {
-		kfree(thread->t_stack);
+		slab_free(&stack_cache, thread->t_stack);
 	}
 
 	kfree(thread->t_name);
-	kfree(thread);
+	slab_free(&thread_cache, thread);
 }
 
 
@@ -274,20 +309,14 @@ thread_fork_nalloc(const char *name,
 	int s, result;
 	(void)name;
 
-	/* Allocate a stack */
-	newguy->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack. It already has its magic number */
+	newguy->t_stack = slab_alloc(&stack_cache);
 	if (newguy->t_stack==NULL) {
 		kfree(newguy->t_name);
-		kfree(newguy);
+		slab_free(&thread_cache, newguy);
 		return ENOMEM;
 	}
 
-	/* stick a magic number on the bottom end of the stack */
-	newguy->t_stack[0] = 0xae;
-	newguy->t_stack[1] = 0x11;
-	newguy->t_stack[2] = 0xda;
-	newguy->t_stack[3] = 0x33;
-
 	/* Inherit the current directory */
 	if (curthread->t_cwd != NULL) {
 		VOP_INCREF(curthread->t_cwd);
@@ -347,9 +376,9 @@ thread_fork_nalloc(const char *name,
 	if (newguy->t_cwd != NULL) {
 		VOP_DECREF(newguy->t_cwd);
 	}
-	kfree(newguy->t_stack);
+	slab_free(&stack_cache, newguy->t_stack);
 	kfree(newguy->t_name);
-	kfree(newguy);
+	slab_free(&thread_cache, newguy);
 
 	return result;
 }
@@ -493,6 +522,16 @@ thread_exit(void)
 		curthread->t_cwd = NULL;
 	}
 
+	int i;
+	for(i = 0; i < OPEN_MAX; ++i)
+	{
+		if(curthread->t_files[i] != NULL)
+		{
+			vfs_close(curthread->t_files[i]);
+			curthread->t_files[i] = NULL;
+		}
+	}
+
 	// Make sure that our children have been cleaned up
 	assert(curthread->children == NULL);
 
@@ -575,7 +614,7 @@ thread_wakeup(const void *addr)
 			 * Because we preallocate during thread_fork,
 			 * this should never fail.
 			 */
-			result = make_runnable(t);
+			result = make_runnable_woken(t);
 			assert(result==0);
 		}
 	}
@@ -609,7 +648,7 @@ thread_wakeup_one(const void *addr)
 			 * Because we preallocate during thread_fork,
 			 * this should never fail.
 			 */
-			result = make_runnable(t);
+			result = make_runnable_woken(t);
 			assert(result==0);
 			break;
 		}
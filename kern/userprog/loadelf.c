@@ -39,7 +39,7 @@
  * explicitly.
  */
 
-int load_page_from_executable(char *exec_path, off_t offset, vaddr_t vaddr, paddr_t paddr,
+int load_page_from_executable(struct vnode *v, off_t offset, vaddr_t vaddr, paddr_t paddr,
 	     size_t memsize, size_t filesize)
 {
 	struct uio u;
@@ -49,16 +49,12 @@ int load_page_from_executable(char *exec_path, off_t offset, vaddr_t vaddr, padd
 		filesize = memsize;
 	}
 
-	struct vnode *v;
-	assert(vfs_open(exec_path, O_RDONLY, &v) == 0);
-
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 	assert(memsize <= PAGE_SIZE);
 
 	mk_kuio(&u, (void*)PADDR_TO_KVADDR(paddr), filesize, offset, UIO_READ);
 	assert(VOP_READ(v, &u) == 0);
-	vfs_close(v);
 
 	if (u.uio_resid != 0) {
 		/* short read; problem with executable? */
@@ -255,6 +251,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+	/* Keep the executable open for demand loading. as_destroy closes it */
+	VOP_INCOPEN(v);
+	VOP_INCREF(v);
+	curthread->t_vmspace->as_vnode = v;
+
 	*entrypoint = eh.e_entry;
 	DEBUG(DB_EXEC, "Program entry point 0x%x\n", *entrypoint);
 
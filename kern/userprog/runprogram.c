@@ -147,8 +147,6 @@ runprogram(char *progname, char **args, int argc)
 	}
 
 	vfs_close(v);
-	assert(strlen(progname) < MAX_EXEC_PATH_SIZE);
-	strcpy(curthread->t_vmspace->exec_path, progname);
 	/* Warp to user mode. */
 	md_usermode(kargc /*argc*/, (userptr_t)stackptr /*userspace addr of argv*/,
 		    stackptr, entrypoint);
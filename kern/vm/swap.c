@@ -7,29 +7,77 @@
 #include <vfs.h>
 #include <kern/unistd.h>
 #include <synch.h>
+#include <bitmap.h>
+#include <kern/stat.h>
+#include <kern/vmstat.h>
 #include <machine/spl.h>
 
 struct SwapMap
 {
-	// The addrspace who is using this Swap section
-	struct addrspace *as;
-
-	// The first 20 bits is the virtual page number of the
-	// page swapped to this portion.
-	// The bit 0 indicates if this portion is used or not
-	// (if set to 1 means in use, if set to 0 means free)
-	// The mask for this bit is the SWMAP_FLAG_USED defined
-	// below
-	u_int32_t flags;
+	// Number of page table entries (or page directory entries for
+	// swapped page tables) referring to this swap section. Zero means
+	// the section is free. A parent and its forked children share the
+	// sections of pages that were on disk when they forked.
+	u_int32_t refcount;
+
+	// First chunk of the compressed copy of the page in the pool, or
+	// -1 if the page is on the disk
+	int32_t zchunk;
+	u_int32_t zlen;
 };
 
+/*
+ * One entry per page sized section of the swap disk. Sized from the
+ * disk in swap_bootstrap. Free sections are clear in swap_free_map.
+ */
+static u_int32_t swap_map_size = 0;
+static struct SwapMap *swap_map = NULL;
+static struct bitmap *swap_free_map = NULL;
+
+/* The swap disk. Opened once at boot */
+static struct vnode *swap_vnode = NULL;
 
-#define SWAP_MAP_SIZE 1280
-struct SwapMap swap_map[SWAP_MAP_SIZE];
+/*
+ * Clustered requests go through this buffer, since the frames of a cluster
+ * are rarely adjacent in memory. Protected by the swap lock
+ */
+static char *swap_cluster_buf = NULL;
 
-#define SWMAP_FLAG_USED		0x00000001 // Mask for used bit in flag above
 #define SWAP_GLOBAL_OFFSET	0	// A global offset if our file has one
 
+/*
+ * The compressed pool. Compressed pages take whole ZSWAP_CHUNK byte chunks
+ * of it, adjacent ones. A chunk in use is set in zswap_chunk_map. A page
+ * that doesn't compress to ZSWAP_MAX_LEN bytes isn't worth keeping and
+ * goes to the disk. Protected by the swap lock
+ */
+#define ZSWAP_CHUNK		64
+#define ZSWAP_NCHUNKS		(ZSWAP_POOL_PAGES * PAGE_SIZE / ZSWAP_CHUNK)
+#define ZSWAP_MAX_LEN		(PAGE_SIZE / 2)
+
+int swap_zpool_pages = ZSWAP_POOL_PAGES;
+static char *zswap_pool = NULL;
+static struct bitmap *zswap_chunk_map = NULL;
+
+/*
+ * Compressor state. Pages are compressed into zswap_buf first since we
+ * don't know how many chunks they need until they are
+ */
+#define ZSWAP_HASH_BITS		10
+#define ZSWAP_MIN_MATCH		3
+#define ZSWAP_MAX_MATCH		(ZSWAP_MIN_MATCH + 0x7f)
+#define ZSWAP_HASH(p)	((((p)[0] << 16 | (p)[1] << 8 | (p)[2]) * 2654435761U) >> (32 - ZSWAP_HASH_BITS))
+
+static int16_t zswap_hash[1 << ZSWAP_HASH_BITS];
+static unsigned char zswap_buf[ZSWAP_MAX_LEN];
+
+/* Compressed pool counters (see kern/vmstat.h) */
+static u_int32_t zswap_stores = 0;
+static u_int32_t zswap_loads = 0;
+static u_int32_t zswap_spills = 0;
+static u_int32_t zswap_pages = 0;
+static u_int32_t zswap_bytes = 0;
+
 struct SwapEntryInfo
 {
 	struct addrspace *as;        // The address space to which this swapped page belongs to
@@ -59,149 +107,488 @@ typedef enum
  */
 off_t find_free_swap_section(int *free_index)
 {
-	int i;
-	for(i = 0; i < SWAP_MAP_SIZE; ++i)
+	u_int32_t index;
+
+	if(swap_free_map == NULL || bitmap_alloc(swap_free_map, &index) != 0)
+	{
+		panic("Out of swap space!\n");
+	}
+
+	*free_index = index;
+	return ((index * PAGE_SIZE) + SWAP_GLOBAL_OFFSET);
+}
+
+/*
+ * Return the position of a swap section in the swap file
+ */
+static off_t swap_section_location(u_int32_t slot)
+{
+	assert(slot < swap_map_size);
+	assert(swap_map[slot].refcount > 0);
+	return ((slot * PAGE_SIZE) + SWAP_GLOBAL_OFFSET);
+}
+
+/*
+ * Pages are compressed with a small LZ77 coder. The output is a run of
+ * tokens. A token byte below 0x80 is followed by that many plus one
+ * literal bytes. One of 0x80 or above copies (token & 0x7f) + ZSWAP_MIN_MATCH
+ * bytes from earlier in the page, as far back as the 12 bit distance (less
+ * one) in the two bytes after it. Copies may overlap what they write, so a
+ * zeroed page takes just under a hundred bytes.
+ */
+
+/*
+ * Append 'n' literal bytes at 'lit' to 'dst'. Returns -1 if that goes
+ * past 'limit'
+ */
+static int zswap_put_literals(const unsigned char *lit, int n, unsigned char *dst, int *op, int limit)
+{
+	int k;
+
+	while(n > 0)
 	{
-		if(!(swap_map[i].flags & SWMAP_FLAG_USED))
+		k = (n > 0x80) ? 0x80 : n;
+		if(*op + 1 + k > limit)
 		{
-			*free_index = i;
-			return ((i * PAGE_SIZE) + SWAP_GLOBAL_OFFSET);
+			return -1;
 		}
+		dst[(*op)++] = k - 1;
+		memcpy(dst + *op, lit, k);
+		*op += k;
+		lit += k;
+		n -= k;
 	}
-
-	panic("Out of swap space!\n");
 	return 0;
 }
 
 /*
- * Return the position of a particular page given its vpn
- * and addrspace. Panic if we can't find it
+ * Compress the page at 'src' into 'dst'. Returns the compressed length,
+ * or -1 if it is more than 'limit' bytes. Must hold the swap lock
  */
+static int zswap_compress(const unsigned char *src, unsigned char *dst, int limit)
+{
+	int ip = 0, op = 0, lit = 0;
+	int h, cand, len, dist;
 
-off_t find_swapped_page_location(struct addrspace *as, vaddr_t vpn,
-		swap_option opt)
+	for(h = 0; h < (1 << ZSWAP_HASH_BITS); ++h)
+	{
+		zswap_hash[h] = -1;
+	}
+
+	while(ip + ZSWAP_MIN_MATCH <= PAGE_SIZE)
+	{
+		h = ZSWAP_HASH(src + ip);
+		cand = zswap_hash[h];
+		zswap_hash[h] = ip;
+		if(cand < 0 || src[cand] != src[ip] || src[cand + 1] != src[ip + 1] ||
+				src[cand + 2] != src[ip + 2])
+		{
+			ip++;
+			continue;
+		}
+
+		if(zswap_put_literals(src + lit, ip - lit, dst, &op, limit) || op + 3 > limit)
+		{
+			return -1;
+		}
+		len = ZSWAP_MIN_MATCH;
+		while(ip + len < PAGE_SIZE && len < ZSWAP_MAX_MATCH && src[cand + len] == src[ip + len])
+		{
+			len++;
+		}
+		dist = ip - cand - 1;
+		dst[op++] = 0x80 | (len - ZSWAP_MIN_MATCH);
+		dst[op++] = dist >> 8;
+		dst[op++] = dist & 0xff;
+		ip += len;
+		lit = ip;
+	}
+
+	if(zswap_put_literals(src + lit, PAGE_SIZE - lit, dst, &op, limit))
+	{
+		return -1;
+	}
+	return op;
+}
+
+/*
+ * Undo zswap_compress. 'len' bytes at 'src' make up exactly one page
+ */
+static void zswap_decompress(const unsigned char *src, int len, unsigned char *dst)
 {
-	int i;
-	for(i = 0; i < SWAP_MAP_SIZE; ++i)
+	int ip = 0, op = 0, n, dist;
+
+	while(ip < len)
+	{
+		if(src[ip] < 0x80)
+		{
+			n = src[ip++] + 1;
+			assert(ip + n <= len && op + n <= PAGE_SIZE);
+			memcpy(dst + op, src + ip, n);
+			ip += n;
+			op += n;
+		}
+		else
+		{
+			assert(ip + 3 <= len);
+			n = (src[ip] & 0x7f) + ZSWAP_MIN_MATCH;
+			dist = ((src[ip + 1] << 8) | src[ip + 2]) + 1;
+			ip += 3;
+			assert(dist <= op && op + n <= PAGE_SIZE);
+			while(n-- > 0)
+			{
+				dst[op] = dst[op - dist];
+				op++;
+			}
+		}
+	}
+	assert(op == PAGE_SIZE);
+}
+
+/*
+ * Find 'nchunks' free chunks in a row in the part of the pool we may use.
+ * Returns the first of them, marked used, or -1. Must hold the swap lock
+ */
+static int zswap_alloc_chunks(int nchunks)
+{
+	int limit = swap_zpool_pages * (PAGE_SIZE / ZSWAP_CHUNK);
+	int i, first, run = 0;
+
+	for(i = 0; i < limit; ++i)
 	{
-		if((swap_map[i].flags & SWMAP_FLAG_USED) && (swap_map[i].as == as)
-				&& ((swap_map[i].flags & PAGE_FRAME) == vpn))
+		if(bitmap_isset(zswap_chunk_map, i))
+		{
+			run = 0;
+			continue;
+		}
+		if(++run == nchunks)
 		{
-			if(opt == SWAP_MOVE_IN)
+			first = i - nchunks + 1;
+			for(i = first; i < first + nchunks; ++i)
 			{
-				swap_map[i].flags = 0;
+				bitmap_mark(zswap_chunk_map, i);
 			}
-			return ((i * PAGE_SIZE) + SWAP_GLOBAL_OFFSET);
+			return first;
 		}
 	}
-	switch(opt)
+	return -1;
+}
+
+/*
+ * Drop the compressed copy of a section's page, if it has one. Must hold
+ * the swap lock
+ */
+static void zswap_release(u_int32_t slot)
+{
+	int32_t i, end;
+
+	if(swap_map[slot].zchunk < 0)
 	{
-	case SWAP_COPY_IN: kprintf("SWAP_COPY_IN\n"); break;
-	case SWAP_MOVE_IN: kprintf("SWAP_MOVE_IN\n");break;
-	default: kprintf("Invalid option\n"); break;
+		return;
 	}
-	panic("Could not find swapped page for addrspace: 0x%x, vpn: 0x%x\n", (vaddr_t)as, vpn);
-	return 0;
+	end = swap_map[slot].zchunk + (swap_map[slot].zlen + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+	for(i = swap_map[slot].zchunk; i < end; ++i)
+	{
+		bitmap_unmark(zswap_chunk_map, i);
+	}
+	zswap_pages--;
+	zswap_bytes -= swap_map[slot].zlen;
+	swap_map[slot].zchunk = -1;
+	swap_map[slot].zlen = 0;
 }
 
 /*
- * Bring a page in from the disk to physical memory
+ * Try to keep the page at 'page_addr' in the compressed pool as section
+ * 'slot'. Returns 0 if it has to go to the disk. Must hold the swap lock
  */
-void swap_in_page(struct addrspace *as, vaddr_t vpn, paddr_t free_page)
+static int zswap_store(u_int32_t slot, paddr_t page_addr)
+{
+	int len, first;
+
+	// Any copy we had is stale
+	zswap_release(slot);
+	if(zswap_pool == NULL || swap_zpool_pages == 0)
+	{
+		return 0;
+	}
+
+	len = zswap_compress((unsigned char*)PADDR_TO_KVADDR(page_addr), zswap_buf, ZSWAP_MAX_LEN);
+	first = (len < 0) ? -1 : zswap_alloc_chunks((len + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK);
+	if(first < 0)
+	{
+		zswap_spills++;
+		return 0;
+	}
+
+	memcpy(zswap_pool + first * ZSWAP_CHUNK, zswap_buf, len);
+	swap_map[slot].zchunk = first;
+	swap_map[slot].zlen = len;
+	zswap_stores++;
+	zswap_pages++;
+	zswap_bytes += len;
+	return 1;
+}
+
+/*
+ * Drop a reference to a section. Must hold the swap lock
+ */
+static void swap_map_decref(u_int32_t slot)
+{
+	assert(slot < swap_map_size);
+	assert(swap_map[slot].refcount > 0);
+	swap_map[slot].refcount--;
+	if(swap_map[slot].refcount == 0)
+	{
+		zswap_release(slot);
+		bitmap_unmark(swap_free_map, slot);
+	}
+}
+
+/*
+ * Do one disk request covering the 'npages' sections starting at 'first'.
+ * A single page goes straight to or from its frame, a cluster is staged in
+ * swap_cluster_buf. Must hold the swap lock
+ */
+static void swap_cluster_io(u_int32_t first, paddr_t *page_addrs, int npages, enum uio_rw rw)
 {
 	struct uio ku;
+	off_t pos;
+	int i;
+	void *buf;
 
-	struct vnode *v;
-	char swapfilename[sizeof(SWAP_FILE_NAME) + 1];
-	strcpy(swapfilename, SWAP_FILE_NAME);
+	assert(npages > 0 && npages <= SWAP_CLUSTER_MAX);
+	assert(first + npages <= swap_map_size);
+	for(i = 0; i < npages; ++i)
+	{
+		assert(swap_map[first + i].refcount > 0);
+	}
+	pos = swap_section_location(first);
 
-	lock_acquire(swap_lock);
-//	kprintf("SWP: Swap move in as:0x%x, vpn:0x%x\n", as, vpn);
-	off_t pos = find_swapped_page_location(as, vpn, SWAP_MOVE_IN);
-	mk_kuio(&ku, (void*)PADDR_TO_KVADDR(free_page), PAGE_SIZE, pos, UIO_READ);
-	assert(vfs_open(swapfilename, O_RDONLY, &v) == 0);
-	assert(VOP_READ(v, &ku) == 0);
+	if(npages == 1)
+	{
+		buf = (void*)PADDR_TO_KVADDR(page_addrs[0]);
+	}
+	else
+	{
+		buf = swap_cluster_buf;
+		if(rw == UIO_WRITE)
+		{
+			for(i = 0; i < npages; ++i)
+			{
+				memcpy(swap_cluster_buf + i * PAGE_SIZE,
+						(void*)PADDR_TO_KVADDR(page_addrs[i]), PAGE_SIZE);
+			}
+		}
+	}
+
+	mk_kuio(&ku, buf, npages * PAGE_SIZE, pos, rw);
+	if(rw == UIO_WRITE)
+	{
+		assert(VOP_WRITE(swap_vnode, &ku) == 0);
+	}
+	else
+	{
+		assert(VOP_READ(swap_vnode, &ku) == 0);
+	}
 	assert(ku.uio_resid == 0);
-	vfs_close(v);
-	lock_release(swap_lock);
 
+	if(npages > 1 && rw == UIO_READ)
+	{
+		for(i = 0; i < npages; ++i)
+		{
+			memcpy((void*)PADDR_TO_KVADDR(page_addrs[i]),
+					swap_cluster_buf + i * PAGE_SIZE, PAGE_SIZE);
+		}
+	}
 }
 
-void swap_copy_in_page(struct addrspace *as, vaddr_t vpn, paddr_t free_page)
+/*
+ * Bring a page in from the disk to physical memory
+ */
+int swap_in_page(u_int32_t slot, paddr_t free_page)
 {
-	struct uio ku;
+	return swap_read_cluster(slot, &free_page, 1, NULL);
+}
 
-	struct vnode *v;
-	char swapfilename[sizeof(SWAP_FILE_NAME) + 1];
-	strcpy(swapfilename, SWAP_FILE_NAME);
+int swap_read_cluster(u_int32_t first, paddr_t *page_addrs, int npages, int *pooled)
+{
+	int i, run, requests = 0;
 
+	assert(npages > 0 && first + npages <= swap_map_size);
 	lock_acquire(swap_lock);
-//	kprintf("SWP: Swap copy in as:0x%x, vpn:0x%x\n", as, vpn);
-	off_t pos = find_swapped_page_location(as, vpn, SWAP_COPY_IN);
-	mk_kuio(&ku, (void*)PADDR_TO_KVADDR(free_page), PAGE_SIZE, pos, UIO_READ);
-	assert(vfs_open(swapfilename, O_RDONLY, &v) == 0);
-	assert(VOP_READ(v, &ku) == 0);
-	assert(ku.uio_resid == 0);
-	vfs_close(v);
+//	kprintf("SWP: Swap in slots:%u-%u\n", first, first + npages - 1);
+	for(i = 0; i < npages; i += run)
+	{
+		if(pooled != NULL)
+		{
+			pooled[i] = (swap_map[first + i].zchunk >= 0);
+		}
+		if(swap_map[first + i].zchunk >= 0)
+		{
+			assert(swap_map[first + i].refcount > 0);
+			zswap_decompress((unsigned char*)zswap_pool + swap_map[first + i].zchunk * ZSWAP_CHUNK,
+					swap_map[first + i].zlen, (unsigned char*)PADDR_TO_KVADDR(page_addrs[i]));
+			zswap_loads++;
+			run = 1;
+			continue;
+		}
+		for(run = 1; i + run < npages && swap_map[first + i + run].zchunk < 0; ++run)
+		{
+			if(pooled != NULL)
+			{
+				pooled[i + run] = 0;
+			}
+		}
+		swap_cluster_io(first + i, page_addrs + i, run, UIO_READ);
+		requests++;
+	}
+	lock_release(swap_lock);
+	return requests;
+}
+
+u_int32_t swap_reserve_slot(void)
+{
+	int free_index;
+
+	lock_acquire(swap_lock);
+	find_free_swap_section(&free_index);
+	swap_map[free_index].refcount = 1;
 	lock_release(swap_lock);
 
+	return free_index;
 }
 
 /*
- * Free the pages on disk corresponding to this address space
+ * Look for 'npages' free sections in a row. Settles for the longest run
+ * there is if there isn't one that long.
  */
-void swap_free_pages(struct addrspace *as)
+int swap_reserve_cluster(int npages, u_int32_t *first)
 {
-	int i;
+	u_int32_t i, run_start = 0, best_start = 0;
+	int run = 0, best = 0;
+
+	assert(npages > 0 && npages <= SWAP_CLUSTER_MAX);
+
+	lock_acquire(swap_lock);
+	for(i = 0; i < swap_map_size && best < npages; ++i)
+	{
+		if(bitmap_isset(swap_free_map, i))
+		{
+			run = 0;
+			continue;
+		}
+		if(run == 0)
+		{
+			run_start = i;
+		}
+		run++;
+		if(run > best)
+		{
+			best = run;
+			best_start = run_start;
+		}
+	}
+	if(best == 0)
+	{
+		panic("Out of swap space!\n");
+	}
+
+	for(i = best_start; i < best_start + best; ++i)
+	{
+		bitmap_mark(swap_free_map, i);
+		swap_map[i].refcount = 1;
+	}
+	lock_release(swap_lock);
+
+	*first = best_start;
+	return best;
+}
+
+int swap_write_page(u_int32_t slot, paddr_t page_addr)
+{
+	return swap_write_cluster(slot, &page_addr, 1);
+}
+
+int swap_write_cluster(u_int32_t first, paddr_t *page_addrs, int npages)
+{
+	int i, run, requests = 0;
+	int stored[SWAP_CLUSTER_MAX];
+
+	assert(npages > 0 && npages <= SWAP_CLUSTER_MAX);
+	assert(first + npages <= swap_map_size);
 	lock_acquire(swap_lock);
-//	kprintf("SWP: Swap free all as:0x%x\n", as);
-	for(i = 0; i < SWAP_MAP_SIZE; ++i)
+//	kprintf("SWP: Swapping out to slots:%u-%u\n", first, first + npages - 1);
+	for(i = 0; i < npages; ++i)
+	{
+		assert(swap_map[first + i].refcount > 0);
+		stored[i] = zswap_store(first + i, page_addrs[i]);
+	}
+	for(i = 0; i < npages; i += run)
 	{
-		if(swap_map[i].as == as)
+		if(stored[i])
 		{
-			swap_map[i].flags = 0;
+			run = 1;
+			continue;
 		}
+		for(run = 1; i + run < npages && !stored[i + run]; ++run);
+		swap_cluster_io(first + i, page_addrs + i, run, UIO_WRITE);
+		requests++;
 	}
 	lock_release(swap_lock);
+	return requests;
 }
 
 /*
  * Swap a page from physical memory to disk
  */
+u_int32_t swap_out_page(paddr_t page_addr)
+{
+	u_int32_t slot = swap_reserve_slot();
+	swap_write_page(slot, page_addr);
+	return slot;
+}
 
-void swap_out_page(struct addrspace *as, vaddr_t vpn, paddr_t page_addr)
+void swap_share_slot(u_int32_t slot)
 {
-	struct uio ku;
-	struct vnode *v;
-	int free_index;
-	off_t pos;
-	char swapfilename[sizeof(SWAP_FILE_NAME) + 1];
-	strcpy(swapfilename, SWAP_FILE_NAME);
+	lock_acquire(swap_lock);
+	assert(slot < swap_map_size);
+	assert(swap_map[slot].refcount > 0);
+	swap_map[slot].refcount++;
+	lock_release(swap_lock);
+}
 
+void swap_free_slot(u_int32_t slot)
+{
 	lock_acquire(swap_lock);
-//	kprintf("SWP: Swapping out as:0x%x, vpn:0x%x\n", as, vpn);
-	pos = find_free_swap_section(&free_index);
-	swap_map[free_index].as = as;
-	swap_map[free_index].flags = (vpn & PAGE_FRAME) | SWMAP_FLAG_USED;
-	mk_kuio(&ku, (void*)PADDR_TO_KVADDR(page_addr), PAGE_SIZE, pos, UIO_WRITE);
-	assert(vfs_open(swapfilename, O_RDWR, &v) == 0);
-	assert(VOP_WRITE(v, &ku) == 0);
-	assert(ku.uio_resid == 0);
-	vfs_close(v);
+	swap_map_decref(slot);
 	lock_release(swap_lock);
 }
 
 void reclaim_all_swap_sections()
 {
 	int spl = splhigh();
-	int i;
-	for(i = 0; i < SWAP_MAP_SIZE; ++i)
+	u_int32_t i;
+	for(i = 0; i < swap_map_size; ++i)
 	{
-		swap_map[i].flags = 0;
+		if(swap_map[i].refcount != 0)
+		{
+			swap_map[i].refcount = 0;
+			zswap_release(i);
+			bitmap_unmark(swap_free_map, i);
+		}
 	}
 	splx(spl);
 }
 
+void swap_getstats(struct vmstat *vs)
+{
+	vs->vs_zswap_stores = zswap_stores;
+	vs->vs_zswap_loads = zswap_loads;
+	vs->vs_zswap_spills = zswap_spills;
+	vs->vs_zswap_pages = zswap_pages;
+	vs->vs_zswap_bytes = zswap_bytes;
+}
+
 
 
 #if 0
@@ -616,10 +1003,71 @@ void swap_bootstrap()
 	swap_lock->lock_held = 0;
 	swap_lock->lock_holder = NULL;
 	swap_lock->name = NULL;
-	bzero(swap_map, SWAP_MAP_SIZE * sizeof(struct SwapMap));
+
+	// Open the swap disk once and size the swap map from it
+	char swapfilename[sizeof(SWAP_FILE_NAME) + 1];
+	struct stat st;
+	u_int32_t i;
+	strcpy(swapfilename, SWAP_FILE_NAME);
+	if(vfs_open(swapfilename, O_RDWR, &swap_vnode) != 0)
+	{
+		kprintf("swap: Couldn't open %s. Running without swap\n", SWAP_FILE_NAME);
+		swap_vnode = NULL;
+		swap_zpool_pages = 0;
+		return;
+	}
+	assert(VOP_STAT(swap_vnode, &st) == 0);
+	swap_map_size = (st.st_size - SWAP_GLOBAL_OFFSET) / PAGE_SIZE;
+
+	swap_map = kmalloc(swap_map_size * sizeof(struct SwapMap));
+	swap_free_map = bitmap_create(swap_map_size);
+	swap_cluster_buf = kmalloc(SWAP_CLUSTER_MAX * PAGE_SIZE);
+	if(swap_map == NULL || swap_free_map == NULL || swap_cluster_buf == NULL)
+	{
+		panic("Couldn't allocate memory for the swap map\n");
+	}
+	bzero(swap_map, swap_map_size * sizeof(struct SwapMap));
+	for(i = 0; i < swap_map_size; ++i)
+	{
+		swap_map[i].zchunk = -1;
+	}
+	kprintf("swap: %u pages of swap on %s\n", swap_map_size, SWAP_FILE_NAME);
+
+	// Without the compressed pool everything just goes to the disk
+	zswap_pool = kmalloc(ZSWAP_POOL_PAGES * PAGE_SIZE);
+	zswap_chunk_map = bitmap_create(ZSWAP_NCHUNKS);
+	if(zswap_pool == NULL || zswap_chunk_map == NULL)
+	{
+		kprintf("swap: No memory for the compressed pool\n");
+		if(zswap_pool != NULL)
+		{
+			kfree(zswap_pool);
+			zswap_pool = NULL;
+		}
+		if(zswap_chunk_map != NULL)
+		{
+			bitmap_destroy(zswap_chunk_map);
+			zswap_chunk_map = NULL;
+		}
+		swap_zpool_pages = 0;
+		return;
+	}
+	kprintf("swap: %d pages of compressed swap in memory\n", ZSWAP_POOL_PAGES);
 }
 
 void swap_cleanup()
 {
+	if(swap_vnode != NULL)
+	{
+		vfs_close(swap_vnode);
+		kfree(swap_map);
+		bitmap_destroy(swap_free_map);
+		kfree(swap_cluster_buf);
+	}
+	if(zswap_pool != NULL)
+	{
+		kfree(zswap_pool);
+		bitmap_destroy(zswap_chunk_map);
+	}
 	kfree(swap_lock);
 }
@@ -0,0 +1,123 @@
+/*
+ * mmaptest.c
+ *
+ * Maps a file shared and private, writes through both, writes the shared
+ * pages back with msync and checks, through a new mapping of the file
+ * opened again, that the shared writes made it to the file and the
+ * private one didn't. Then unmaps a page out of the middle of a mapping
+ * and checks the pages on both sides of the hole are still there.
+ *
+ * read only handles the console for now, so the file is read back by
+ * mapping it rather than with read.
+ *
+ * Usage: mmaptest <file>, where the file is at least NPAGES pages long.
+ * The first bytes of each page are overwritten.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define NPAGES		3
+#define MAPSIZE		(NPAGES * PAGESIZE)
+
+static
+void
+mark(char *p, const char *what, int page)
+{
+	snprintf(p + page * PAGESIZE, 32, "mmaptest %s page %d", what, page);
+}
+
+static
+void
+check(const char *p, const char *what, int page, const char *where)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "mmaptest %s page %d", what, page);
+	if (strcmp(p + page * PAGESIZE, buf)) {
+		errx(1, "%s: page %d reads \"%.31s\", expected \"%s\"",
+		     where, page, p + page * PAGESIZE, buf);
+	}
+}
+
+static
+char *
+map(const char *file, int flags, int prot, int mflags)
+{
+	int fd;
+	char *p;
+
+	fd = open(file, flags);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mmap(NULL, MAPSIZE, prot, mflags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", file);
+	}
+	/* The mapping holds the file open */
+	close(fd);
+	return p;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *shared, *private, *copy;
+	int i;
+
+	if (argc != 2) {
+		errx(1, "Usage: mmaptest <file>");
+	}
+
+	shared = map(argv[1], O_RDWR, PROT_READ|PROT_WRITE, MAP_SHARED);
+	private = map(argv[1], O_RDONLY, PROT_READ|PROT_WRITE, MAP_PRIVATE);
+
+	for (i=0; i<NPAGES; i++) {
+		mark(shared, "shared", i);
+	}
+	for (i=0; i<NPAGES; i++) {
+		check(shared, "shared", i, "shared mapping");
+	}
+
+	/* Copy-on-write: the shared mapping doesn't see this */
+	mark(private, "private", 0);
+	check(private, "private", 0, "private mapping");
+	check(shared, "shared", 0, "shared mapping after private write");
+
+	if (msync(shared, MAPSIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+	printf("Wrote %d pages and synced them.\n", NPAGES);
+
+	/* Punch a hole in the middle of the shared mapping */
+	if (munmap(shared + PAGESIZE, PAGESIZE)) {
+		err(1, "munmap of page 1");
+	}
+	check(shared, "shared", 0, "below the hole");
+	check(shared, "shared", 2, "above the hole");
+	mark(shared, "shared", 2);
+	check(shared, "shared", 2, "above the hole, written again");
+	printf("Unmapped page 1, pages 0 and 2 still there.\n");
+
+	if (munmap(shared, PAGESIZE) || munmap(shared + 2*PAGESIZE, PAGESIZE)) {
+		err(1, "munmap");
+	}
+	if (munmap(private, MAPSIZE)) {
+		err(1, "munmap");
+	}
+
+	copy = map(argv[1], O_RDONLY, PROT_READ, MAP_PRIVATE);
+	for (i=0; i<NPAGES; i++) {
+		check(copy, "shared", i, argv[1]);
+	}
+	if (munmap(copy, MAPSIZE)) {
+		err(1, "munmap");
+	}
+
+	printf("Passed mmaptest.\n");
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * sbrktest.c
+ *
+ * Grows the heap, fills it, shrinks it back down to one page and grows
+ * it again. The page that stayed in the heap must keep what was written
+ * to it; the ones that were given back must come back zeroed.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define NPAGES		16
+
+static
+char *
+dosbrk(int change)
+{
+	char *p = sbrk(change);
+
+	if (p == (void *)-1) {
+		err(1, "sbrk(%d)", change);
+	}
+	return p;
+}
+
+int
+main(void)
+{
+	char *heap, *p;
+	int i;
+
+	heap = dosbrk(NPAGES * PAGESIZE);
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		heap[i] = 0x5a;
+	}
+	printf("Filled %d pages at 0x%x\n", NPAGES, (unsigned int)heap);
+
+	/* Down to one page */
+	dosbrk(-(NPAGES - 1) * PAGESIZE);
+	p = dosbrk(0);
+	if (p != heap + PAGESIZE) {
+		errx(1, "Break is 0x%x after shrinking, expected 0x%x",
+		     (unsigned int)p, (unsigned int)(heap + PAGESIZE));
+	}
+	for (i=0; i<PAGESIZE; i++) {
+		if (heap[i] != 0x5a) {
+			errx(1, "Byte %d of the page kept changed", i);
+		}
+	}
+
+	p = dosbrk((NPAGES - 1) * PAGESIZE);
+	if (p != heap + PAGESIZE) {
+		errx(1, "Heap grew back at 0x%x, expected 0x%x",
+		     (unsigned int)p, (unsigned int)(heap + PAGESIZE));
+	}
+	for (i=PAGESIZE; i<NPAGES * PAGESIZE; i++) {
+		if (heap[i] != 0) {
+			errx(1, "Byte %d isn't zero after the heap grew back", i);
+		}
+	}
+
+	dosbrk(-NPAGES * PAGESIZE);
+	printf("Passed sbrktest.\n");
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * vmstattest.c
+ *
+ * Checks that vmstat(VMSTAT_SELF) counts this process's faults. Grows
+ * the heap by NPAGES pages, reads each of them (every read should fault
+ * and map the zero page) and then writes each of them (every write
+ * should fault again and get a zeroed page of its own), checking the
+ * counters after each step.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/vmstat.h>
+
+#define PAGESIZE	4096
+#define NPAGES		8
+
+static
+void
+getstats(struct vmstat *vs)
+{
+	if (vmstat(VMSTAT_SELF, vs)) {
+		err(1, "vmstat");
+	}
+}
+
+static
+void
+expect(const char *what, u_int32_t before, u_int32_t after, u_int32_t atleast)
+{
+	printf("%s: %u -> %u\n", what, before, after);
+	if (after - before < atleast) {
+		errx(1, "%s went up by %u, expected at least %u",
+		     what, after - before, atleast);
+	}
+}
+
+int
+main(void)
+{
+	struct vmstat before, after;
+	volatile char *heap;
+	int i, sum = 0;
+
+	heap = sbrk(NPAGES * PAGESIZE);
+	if (heap == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	/* Untouched heap pages: reads map the zero page */
+	getstats(&before);
+	for (i=0; i<NPAGES; i++) {
+		sum += heap[i * PAGESIZE];
+	}
+	getstats(&after);
+	if (sum != 0) {
+		errx(1, "New heap pages aren't zero");
+	}
+	expect("faults", before.vs_faults, after.vs_faults, NPAGES);
+	expect("zero page maps", before.vs_zero_maps, after.vs_zero_maps,
+	       NPAGES);
+
+	/* First writes: each page gets a frame of its own */
+	getstats(&before);
+	for (i=0; i<NPAGES; i++) {
+		heap[i * PAGESIZE] = 1;
+	}
+	getstats(&after);
+	expect("faults", before.vs_faults, after.vs_faults, NPAGES);
+	expect("zero fills", before.vs_zero_fills, after.vs_zero_fills,
+	       NPAGES);
+
+	printf("Passed vmstattest.\n");
+	return 0;
+}